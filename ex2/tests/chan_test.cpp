@@ -0,0 +1,281 @@
+/*
+ * Behaviour tests of the channels: the rendezvous of an unbuffered channel, closing a channel while threads are parked
+ * on it, select with several ready cases, and the move and destroy hooks of typed channels and of uthread::channel.
+ */
+#include "test_utils.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+static uthread_chan *chan;
+
+/* Waits until the thread with ID tid, which gives up the CPU only by parking, parked for the given time. */
+static void wait_parked(int tid, unsigned long long times) {
+  WAIT_UNTIL(voluntary_switches(tid) == times);
+}
+
+static std::atomic<int> sent{0};
+
+static void *send_value(void *value) {
+  int elem = (int) (intptr_t) value;
+  int result = uthread_chan_send(chan, &elem);
+  sent++;
+  return (void *) (intptr_t) result;
+}
+
+/* Receives a value, and returns it shifted left by a byte, with the result of the receive in the low byte. */
+static void *recv_value(void *) {
+  int elem = 0;
+  int result = uthread_chan_recv(chan, &elem);
+  return (void *) (intptr_t) (elem << 8 | result);
+}
+
+static void test_unbuffered_rendezvous() {
+  chan = uthread_chan_create(sizeof(int), 0);
+  CHECK(chan != nullptr);
+  int elem = 1;
+  uthread_chan_case send_case = {chan, UTHREAD_CHAN_SEND, &elem, 0};
+  CHECK(uthread_chan_select(&send_case, 1, 0) == 1);
+
+  // A sender waits for a receiver, which takes the value straight from it.
+  int sender = uthread_spawn_arg(send_value, (void *) 42);
+  wait_parked(sender, 1);
+  CHECK(sent == 0);
+  CHECK(uthread_chan_recv(chan, &elem) == 0);
+  CHECK(elem == 42);
+  void *result;
+  CHECK(uthread_join(sender, &result) == 0);
+  CHECK(result == (void *) 0);
+  CHECK(sent == 1);
+
+  // A receiver waits for a sender, which hands the value over without waiting.
+  int receiver = uthread_spawn_arg(recv_value, nullptr);
+  wait_parked(receiver, 1);
+  elem = 7;
+  CHECK(uthread_chan_send(chan, &elem) == 0);
+  CHECK(uthread_join(receiver, &result) == 0);
+  CHECK(result == (void *) (7 << 8 | 0));
+  CHECK(uthread_chan_destroy(chan) == 0);
+}
+
+static void test_close_while_parked() {
+  chan = uthread_chan_create(sizeof(int), 1);
+  int receiver = uthread_spawn_arg(recv_value, nullptr);
+  wait_parked(receiver, 1);
+  CHECK(uthread_chan_close(chan) == 0);
+  void *result;
+  CHECK(uthread_join(receiver, &result) == 0);
+  CHECK(result == (void *) 1);
+  CHECK(uthread_chan_destroy(chan) == 0);
+
+  // A sender parked on a full channel fails when it is closed, and what was sent before can still be received.
+  chan = uthread_chan_create(sizeof(int), 1);
+  int elem = 5;
+  CHECK(uthread_chan_send(chan, &elem) == 0);
+  int sender = uthread_spawn_arg(send_value, (void *) 6);
+  wait_parked(sender, 1);
+  CHECK(uthread_chan_close(chan) == 0);
+  CHECK(uthread_join(sender, &result) == 0);
+  CHECK(result == (void *) -1);
+  CHECK(uthread_chan_send(chan, &elem) == -1);
+  CHECK(uthread_chan_recv(chan, &elem) == 0);
+  CHECK(elem == 5);
+  CHECK(uthread_chan_recv(chan, &elem) == 1);
+  CHECK(uthread_chan_close(chan) == -1);
+  CHECK(uthread_chan_destroy(chan) == 0);
+}
+
+static uthread_chan *first_chan;
+static uthread_chan *second_chan;
+
+/* Selects a receive from the two channels, and returns the index of the case shifted left by a byte, with the value
+   received in the low byte. */
+static void *select_recv(void *) {
+  int first = 0, second = 0;
+  uthread_chan_case cases[2] = {{first_chan, UTHREAD_CHAN_RECV, &first, 0},
+                                {second_chan, UTHREAD_CHAN_RECV, &second, 0}};
+  int index = uthread_chan_select(cases, 2, 1);
+  return (void *) (intptr_t) (index << 8 | (index == 0 ? first : second));
+}
+
+static void test_select() {
+  first_chan = uthread_chan_create(sizeof(int), 4);
+  second_chan = uthread_chan_create(sizeof(int), 4);
+  int elem = 0;
+  uthread_chan_case cases[2] = {{first_chan, UTHREAD_CHAN_RECV, &elem, 0},
+                                {second_chan, UTHREAD_CHAN_RECV, &elem, 0}};
+  CHECK(uthread_chan_select(cases, 2, 0) == 2);
+
+  // With both cases ready, the starting case rotates, so two selects take one value from each channel.
+  for (int i = 0; i < 2; i++) {
+      elem = 10 + i;
+      CHECK(uthread_chan_send(first_chan, &elem) == 0);
+      elem = 20 + i;
+      CHECK(uthread_chan_send(second_chan, &elem) == 0);
+    }
+  bool seen[2] = {false, false};
+  for (int i = 0; i < 2; i++) {
+      int index = uthread_chan_select(cases, 2, 0);
+      CHECK(index == 0 or index == 1);
+      CHECK(elem == (index == 0 ? 10 : 20));
+      seen[index] = true;
+    }
+  CHECK(seen[0] and seen[1]);
+  CHECK(uthread_chan_recv(first_chan, &elem) == 0 and elem == 11);
+  CHECK(uthread_chan_recv(second_chan, &elem) == 0 and elem == 21);
+
+  // A ready send case and a ready receive case.
+  elem = 30;
+  CHECK(uthread_chan_send(second_chan, &elem) == 0);
+  int out = 40, in = 0;
+  uthread_chan_case mixed[2] = {{first_chan, UTHREAD_CHAN_SEND, &out, 0},
+                                {second_chan, UTHREAD_CHAN_RECV, &in, 0}};
+  int done[2] = {0, 0};
+  for (int i = 0; i < 2; i++) {
+      done[uthread_chan_select(mixed, 2, 0)]++;
+    }
+  CHECK(done[0] >= 1 and done[0] + done[1] == 2);
+  CHECK(in == (done[1] == 1 ? 30 : 0));
+
+  // A parked select completes with the case of the first channel that gets a value, and leaves the other one.
+  while (uthread_chan_select(cases, 2, 0) != 2) {
+    }
+  int selecting = uthread_spawn_arg(select_recv, nullptr);
+  wait_parked(selecting, 1);
+  elem = 50;
+  CHECK(uthread_chan_send(second_chan, &elem) == 0);
+  void *result;
+  CHECK(uthread_join(selecting, &result) == 0);
+  CHECK(result == (void *) (1 << 8 | 50));
+  elem = 60;
+  CHECK(uthread_chan_send(first_chan, &elem) == 0);
+  CHECK(uthread_chan_recv(first_chan, &elem) == 0 and elem == 60);
+
+  // Closing a channel completes a parked select, with the closed field of its case set.
+  selecting = uthread_spawn_arg(select_recv, nullptr);
+  wait_parked(selecting, 1);
+  CHECK(uthread_chan_close(first_chan) == 0);
+  CHECK(uthread_join(selecting, &result) == 0);
+  CHECK(result == (void *) (0 << 8 | 0));
+  CHECK(uthread_chan_select(cases, 2, 0) == 0);
+  CHECK(cases[0].closed == 1);
+  CHECK(uthread_chan_destroy(first_chan) == 0);
+  CHECK(uthread_chan_destroy(second_chan) == 0);
+}
+
+static int moves = 0;
+static int destroys = 0;
+
+static void count_move(void *dst, void *src) {
+  *static_cast<int *>(dst) = *static_cast<int *>(src);
+  moves++;
+}
+
+static void count_destroy(void *) {
+  destroys++;
+}
+
+static void test_typed_hooks() {
+  chan = uthread_chan_create_typed(sizeof(int), 4, count_move, count_destroy);
+  CHECK(chan != nullptr);
+  for (int elem = 0; elem < 3; elem++) {
+      CHECK(uthread_chan_send(chan, &elem) == 0);
+    }
+  CHECK(moves == 3 and destroys == 0);
+  // A received value is moved out of the buffer, which destroys what is left in its slot.
+  int elem;
+  CHECK(uthread_chan_recv(chan, &elem) == 0 and elem == 0);
+  CHECK(moves == 4 and destroys == 1);
+
+  // A value handed to a parked receiver is moved once, and stays owned by the sender.
+  while (uthread_chan_recv(chan, &elem) == 0 and elem != 2) {
+    }
+  moves = destroys = 0;
+  int receiver = uthread_spawn_arg(recv_value, nullptr);
+  wait_parked(receiver, 1);
+  elem = 9;
+  CHECK(uthread_chan_send(chan, &elem) == 0);
+  void *result;
+  CHECK(uthread_join(receiver, &result) == 0);
+  CHECK(result == (void *) (9 << 8 | 0));
+  CHECK(moves == 1 and destroys == 0);
+
+  // Destroying the channel destroys the values left in it.
+  for (elem = 0; elem < 2; elem++) {
+      CHECK(uthread_chan_send(chan, &elem) == 0);
+    }
+  CHECK(uthread_chan_destroy(chan) == 0);
+  CHECK(moves == 3 and destroys == 2);
+}
+
+/* Counts its live instances, to check uthread::channel constructs and destroys its values in pairs. */
+struct Tracked {
+  static int live;
+  int value;
+
+  explicit Tracked(int value = 0) : value(value) { live++; }
+  Tracked(const Tracked &other) : value(other.value) { live++; }
+  Tracked(Tracked &&other) noexcept : value(other.value) {
+    other.value = -1;
+    live++;
+  }
+  Tracked &operator=(Tracked &&other) noexcept {
+    value = other.value;
+    other.value = -1;
+    return *this;
+  }
+  ~Tracked() { live--; }
+};
+
+int Tracked::live = 0;
+
+static uthread::channel<std::unique_ptr<int>> *pointers;
+
+static void *recv_pointer(void *) {
+  std::unique_ptr<int> pointer;
+  CHECK(pointers->recv(pointer) == 0);
+  return (void *) (intptr_t) *pointer;
+}
+
+static void test_channel_template() {
+  {
+    uthread::channel<Tracked> tracked(4);
+    for (int i = 1; i <= 3; i++) {
+        CHECK(tracked.send(Tracked(i)) == 0);
+      }
+    CHECK(Tracked::live == 3);
+    Tracked received;
+    CHECK(tracked.recv(received) == 0);
+    CHECK(received.value == 1);
+    CHECK(Tracked::live == 3);
+    CHECK(tracked.close() == 0);
+  }
+  CHECK(Tracked::live == 0);
+
+  // Move-only values pass through the buffer and directly to a parked receiver.
+  uthread::channel<std::unique_ptr<int>> channel(1);
+  pointers = &channel;
+  CHECK(channel.send(std::unique_ptr<int>(new int(3))) == 0);
+  std::unique_ptr<int> pointer;
+  CHECK(channel.recv(pointer) == 0);
+  CHECK(pointer != nullptr and *pointer == 3);
+  int receiver = uthread_spawn_arg(recv_pointer, nullptr);
+  wait_parked(receiver, 1);
+  CHECK(channel.send(std::move(pointer)) == 0);
+  void *result;
+  CHECK(uthread_join(receiver, &result) == 0);
+  CHECK(result == (void *) 3);
+  CHECK(channel.close() == 0);
+  CHECK(channel.recv(pointer) == 1);
+}
+
+
+int main(int argc, char **argv) {
+  init_test(argc, argv);
+  test_unbuffered_rendezvous();
+  test_close_while_parked();
+  test_select();
+  test_typed_hooks();
+  test_channel_template();
+  uthread_terminate(0);
+}
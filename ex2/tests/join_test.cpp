@@ -0,0 +1,157 @@
+/*
+ * Behaviour tests of uthread_join and uthread_exit: several joiners of one thread, joining a thread that already
+ * finished, joining threads ended by uthread_terminate, and the reuse of the tid of a joined thread.
+ */
+#include "test_utils.h"
+#include <cstdint>
+
+#define JOINERS 3
+
+static uthread_sem go = UTHREAD_SEM_INITIALIZER(0);
+
+/* Returns its argument once go is posted. */
+static void *return_when_released(void *value) {
+  CHECK(uthread_sem_wait(&go) == 0);
+  return value;
+}
+
+/* Exits with its argument, from a nested call. */
+static void exit_with(void *value) {
+  uthread_exit(value);
+}
+
+static void *exit_at_once(void *value) {
+  exit_with(value);
+  CHECK(false);
+  return nullptr;
+}
+
+/* Joins the thread whose tid it is given, and returns the exit value it got. */
+static void *join_thread(void *tid) {
+  void *value = (void *) -1;
+  CHECK(uthread_join((int) (intptr_t) tid, &value) == 0);
+  return value;
+}
+
+static void park_forever() {
+  CHECK(uthread_block(uthread_get_tid()) == 0);
+}
+
+static void test_multiple_joiners() {
+  int target = uthread_spawn_arg(return_when_released, (void *) 123);
+  int joiners[JOINERS];
+  for (int i = 0; i < JOINERS; i++) {
+      joiners[i] = uthread_spawn_arg(join_thread, (void *) (intptr_t) target);
+      WAIT_UNTIL(voluntary_switches(joiners[i]) == 1);
+    }
+  CHECK(uthread_sem_post(&go) == 0);
+  for (int i = 0; i < JOINERS; i++) {
+      void *value;
+      CHECK(uthread_join(joiners[i], &value) == 0);
+      CHECK(value == (void *) 123);
+    }
+  // The joiners released the target, it cannot be joined again.
+  CHECK(uthread_join(target, nullptr) == -1);
+
+  // A joiner terminated while it waits leaves the target to be joined later.
+  target = uthread_spawn_arg(return_when_released, (void *) 7);
+  int joiner = uthread_spawn_arg(join_thread, (void *) (intptr_t) target);
+  WAIT_UNTIL(voluntary_switches(joiner) == 1);
+  CHECK(uthread_terminate(joiner) == 0);
+  CHECK(uthread_sem_post(&go) == 0);
+  void *value;
+  CHECK(uthread_join(joiner, &value) == 0);
+  CHECK(value == nullptr);
+  CHECK(uthread_join(target, &value) == 0);
+  CHECK(value == (void *) 7);
+}
+
+/* Returns the number of threads that are running or ready, the main thread included. */
+static int runnable_threads() {
+  uthread_sched_stats stats;
+  CHECK(uthread_get_sched_stats(&stats) == 0);
+  return stats.running + stats.ready;
+}
+
+/* Returns the number of tids in use, the main thread and finished threads not joined yet included. */
+static int used_tids() {
+  uthread_sched_stats stats;
+  CHECK(uthread_get_sched_stats(&stats) == 0);
+  return stats.threads;
+}
+
+static void test_join_after_exit() {
+  int tid = uthread_spawn_arg(exit_at_once, (void *) 55);
+  WAIT_UNTIL(runnable_threads() == 1);
+  // The finished thread keeps its tid and value until it is joined, and can no longer be terminated.
+  CHECK(used_tids() == 2);
+  CHECK(uthread_terminate(tid) == -1);
+  void *value = nullptr;
+  CHECK(uthread_join(tid, &value) == 0);
+  CHECK(value == (void *) 55);
+  CHECK(used_tids() == 1);
+  CHECK(uthread_join(tid, &value) == -1);
+}
+
+static void test_join_terminated() {
+  // A joinable thread ended by uthread_terminate is kept until it is joined, with a NULL exit value.
+  int tid = uthread_spawn_arg(return_when_released, (void *) 9);
+  CHECK(uthread_terminate(tid) == 0);
+  void *value = (void *) 1;
+  CHECK(uthread_join(tid, &value) == 0);
+  CHECK(value == nullptr);
+  CHECK(uthread_join(tid, &value) == -1);
+
+  // Joiners waiting for a thread get NULL when it is terminated.
+  tid = uthread_spawn_arg(return_when_released, (void *) 9);
+  int joiner = uthread_spawn_arg(join_thread, (void *) (intptr_t) tid);
+  WAIT_UNTIL(voluntary_switches(joiner) == 1);
+  CHECK(uthread_terminate(tid) == 0);
+  CHECK(uthread_join(joiner, &value) == 0);
+  CHECK(value == nullptr);
+
+  // A thread of uthread_spawn is not joinable: once terminated its tid no longer exists, and joining it is an error.
+  tid = uthread_spawn(park_forever);
+  WAIT_UNTIL(voluntary_switches(tid) == 1);
+  CHECK(uthread_terminate(tid) == 0);
+  CHECK(uthread_join(tid, &value) == -1);
+
+  CHECK(uthread_join(0, nullptr) == -1);
+  CHECK(uthread_join(uthread_get_tid(), nullptr) == -1);
+  CHECK(uthread_join(-1, nullptr) == -1);
+}
+
+static void test_tid_reuse() {
+  int tid = uthread_spawn_arg(exit_at_once, (void *) 1);
+  void *value;
+  CHECK(uthread_join(tid, &value) == 0);
+  CHECK(value == (void *) 1);
+  // The lowest free tid is reused, and the new thread has its own exit value and joiners.
+  int reused = uthread_spawn_arg(return_when_released, (void *) 2);
+  CHECK(reused == tid);
+  int joiner = uthread_spawn_arg(join_thread, (void *) (intptr_t) reused);
+  WAIT_UNTIL(voluntary_switches(joiner) == 1);
+  CHECK(uthread_sem_post(&go) == 0);
+  CHECK(uthread_join(joiner, &value) == 0);
+  CHECK(value == (void *) 2);
+
+  // A finished thread that was not joined yet keeps its tid from being reused.
+  tid = uthread_spawn_arg(exit_at_once, (void *) 3);
+  WAIT_UNTIL(runnable_threads() == 1);
+  int next = uthread_spawn_arg(exit_at_once, (void *) 4);
+  CHECK(next != tid);
+  CHECK(uthread_join(tid, &value) == 0);
+  CHECK(value == (void *) 3);
+  CHECK(uthread_join(next, &value) == 0);
+  CHECK(value == (void *) 4);
+}
+
+
+int main(int argc, char **argv) {
+  init_test(argc, argv);
+  test_multiple_joiners();
+  test_join_after_exit();
+  test_join_terminated();
+  test_tid_reuse();
+  uthread_terminate(0);
+}
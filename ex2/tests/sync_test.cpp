@@ -0,0 +1,342 @@
+/*
+ * Behaviour tests of the mutexes, condition variables, semaphores and rwlocks: contention, the FIFO order in which
+ * objects are handed over, the rebinding of a condition variable to another mutex, terminating waiting threads, and
+ * the preference a rwlock gives to waiting writers.
+ */
+#include "test_utils.h"
+#include <atomic>
+#include <cstdint>
+
+#define CONTENDERS 8
+#define INCREMENTS 2000
+#define COND_WAITERS 3
+
+static uthread_mutex counter_mutex = UTHREAD_MUTEX_INITIALIZER;
+static long counter = 0;
+
+/* Increments counter under counter_mutex, sometimes yielding while holding it so the other contenders park. */
+static void *contend(void *) {
+  for (int i = 0; i < INCREMENTS; i++) {
+      CHECK(uthread_mutex_lock(&counter_mutex) == 0);
+      long value = counter;
+      if (i % 50 == 0) {
+          uthread_yield();
+        }
+      counter = value + 1;
+      CHECK(uthread_mutex_unlock(&counter_mutex) == 0);
+    }
+  return nullptr;
+}
+
+static void *try_held(void *) {
+  return (void *) (intptr_t) uthread_mutex_trylock(&counter_mutex);
+}
+
+static void test_mutex_contention() {
+  int tids[CONTENDERS];
+  for (int i = 0; i < CONTENDERS; i++) {
+      tids[i] = uthread_spawn_arg(contend, nullptr);
+      CHECK(tids[i] > 0);
+    }
+  for (int i = 0; i < CONTENDERS; i++) {
+      CHECK(uthread_join(tids[i], nullptr) == 0);
+    }
+  CHECK(counter == CONTENDERS * INCREMENTS);
+  CHECK(peek(counter_mutex.owner) == -1);
+
+  CHECK(uthread_mutex_trylock(&counter_mutex) == 0);
+  CHECK(uthread_mutex_lock(&counter_mutex) == -1);
+  void *result;
+  CHECK(uthread_join(uthread_spawn_arg(try_held, nullptr), &result) == 0);
+  CHECK(result == (void *) 1);
+  CHECK(uthread_mutex_unlock(&counter_mutex) == 0);
+  CHECK(uthread_mutex_unlock(&counter_mutex) == -1);
+}
+
+
+static uthread_mutex handoff_mutex = UTHREAD_MUTEX_INITIALIZER;
+static uthread_sem release = UTHREAD_SEM_INITIALIZER(0);
+static int lock_order[CONTENDERS];
+static std::atomic<int> locked{0};
+
+/* Records the order in which it got handoff_mutex, and holds it until release is posted. */
+static void *lock_in_turn(void *) {
+  CHECK(uthread_mutex_lock(&handoff_mutex) == 0);
+  lock_order[locked++] = uthread_get_tid();
+  CHECK(uthread_sem_wait(&release) == 0);
+  CHECK(uthread_mutex_unlock(&handoff_mutex) == 0);
+  return nullptr;
+}
+
+static void test_mutex_handoff() {
+  int tids[CONTENDERS];
+  CHECK(uthread_mutex_lock(&handoff_mutex) == 0);
+  for (int i = 0; i < CONTENDERS; i++) {
+      tids[i] = uthread_spawn_arg(lock_in_turn, nullptr);
+      WAIT_UNTIL(peek(handoff_mutex.waiters.tail) == tids[i]);
+    }
+  CHECK(uthread_mutex_unlock(&handoff_mutex) == 0);
+  // The first waiter owns the mutex as soon as it is unlocked, before it runs.
+  CHECK(peek(handoff_mutex.owner) == tids[0]);
+  CHECK(uthread_mutex_trylock(&handoff_mutex) == 1);
+  for (int i = 0; i < CONTENDERS; i++) {
+      CHECK(uthread_sem_post(&release) == 0);
+    }
+  for (int i = 0; i < CONTENDERS; i++) {
+      CHECK(uthread_join(tids[i], nullptr) == 0);
+    }
+  for (int i = 0; i < CONTENDERS; i++) {
+      CHECK(lock_order[i] == tids[i]);
+    }
+  CHECK(peek(handoff_mutex.owner) == -1);
+}
+
+
+static uthread_sem units = UTHREAD_SEM_INITIALIZER(0);
+
+static void *take_unit(void *) {
+  CHECK(uthread_sem_wait(&units) == 0);
+  return (void *) (intptr_t) uthread_get_tid();
+}
+
+static void test_sem() {
+  CHECK(uthread_sem_post(&units) == 0);
+  CHECK(uthread_sem_post(&units) == 0);
+  CHECK(uthread_sem_trywait(&units) == 0);
+  CHECK(uthread_sem_trywait(&units) == 0);
+  CHECK(uthread_sem_trywait(&units) == 1);
+
+  int first = uthread_spawn_arg(take_unit, nullptr);
+  WAIT_UNTIL(peek(units.waiters.head) == first);
+  int second = uthread_spawn_arg(take_unit, nullptr);
+  WAIT_UNTIL(peek(units.waiters.tail) == second);
+  // A posted unit goes to the first waiter rather than to the semaphore.
+  CHECK(uthread_sem_post(&units) == 0);
+  CHECK(peek(units.value) == 0);
+  CHECK(uthread_sem_trywait(&units) == 1);
+  void *result;
+  CHECK(uthread_join(first, &result) == 0);
+  CHECK(result == (void *) (intptr_t) first);
+  CHECK(peek(units.waiters.head) == second);
+
+  // A terminated waiter leaves the queue, and does not take the next unit.
+  CHECK(uthread_terminate(second) == 0);
+  CHECK(peek(units.waiters.head) == -1);
+  CHECK(uthread_sem_post(&units) == 0);
+  CHECK(peek(units.value) == 1);
+  CHECK(uthread_join(second, nullptr) == 0);
+  CHECK(uthread_sem_trywait(&units) == 0);
+}
+
+
+static uthread_cond cond = UTHREAD_COND_INITIALIZER;
+static uthread_mutex cond_mutex = UTHREAD_MUTEX_INITIALIZER;
+static uthread_mutex other_mutex = UTHREAD_MUTEX_INITIALIZER;
+static int entered = 0; /* waiters that reached the condition variable, under the mutex they wait with */
+static int tokens = 0; /* waiters allowed to leave, under the same mutex */
+static int wait_order[COND_WAITERS];
+static std::atomic<int> woken{0};
+
+/* Waits on cond with the mutex it is given until a token is available, and takes it. */
+static void *wait_for_token(void *mutex) {
+  auto *held = static_cast<uthread_mutex *>(mutex);
+  CHECK(uthread_mutex_lock(held) == 0);
+  if (entered < COND_WAITERS) {
+      wait_order[entered] = uthread_get_tid();
+    }
+  entered++;
+  while (tokens == 0) {
+      CHECK(uthread_cond_wait(&cond, held) == 0);
+    }
+  tokens--;
+  woken++;
+  CHECK(uthread_mutex_unlock(held) == 0);
+  return nullptr;
+}
+
+static int waiters_entered(uthread_mutex *mutex) {
+  CHECK(uthread_mutex_lock(mutex) == 0);
+  int result = entered;
+  CHECK(uthread_mutex_unlock(mutex) == 0);
+  return result;
+}
+
+/* Lets one waiter of cond, which waits with mutex, leave and waits until it did. */
+static void signal_waiter(uthread_mutex *mutex, int tid) {
+  CHECK(uthread_mutex_lock(mutex) == 0);
+  tokens++;
+  CHECK(uthread_cond_signal(&cond) == 0);
+  CHECK(uthread_mutex_unlock(mutex) == 0);
+  CHECK(uthread_join(tid, nullptr) == 0);
+}
+
+static void test_cond() {
+  int tids[COND_WAITERS];
+  for (int i = 0; i < COND_WAITERS; i++) {
+      tids[i] = uthread_spawn_arg(wait_for_token, &cond_mutex);
+    }
+  WAIT_UNTIL(waiters_entered(&cond_mutex) == COND_WAITERS);
+
+  // A signalled waiter is moved to the queue of the held mutex instead of running.
+  CHECK(uthread_mutex_lock(&cond_mutex) == 0);
+  CHECK(cond.mutex == &cond_mutex);
+  tokens = 1;
+  CHECK(uthread_cond_signal(&cond) == 0);
+  CHECK(peek(cond_mutex.waiters.head) == wait_order[0]);
+  CHECK(woken == 0);
+  CHECK(uthread_mutex_unlock(&cond_mutex) == 0);
+  WAIT_UNTIL(woken == 1);
+
+  CHECK(uthread_mutex_lock(&cond_mutex) == 0);
+  tokens = COND_WAITERS - 1;
+  CHECK(uthread_cond_broadcast(&cond) == 0);
+  CHECK(peek(cond_mutex.waiters.head) == wait_order[1]);
+  CHECK(peek(cond_mutex.waiters.tail) == wait_order[2]);
+  // With its last waiter gone, the condition variable is no longer bound to the mutex.
+  CHECK(cond.mutex == nullptr);
+  CHECK(uthread_mutex_unlock(&cond_mutex) == 0);
+  for (int i = 0; i < COND_WAITERS; i++) {
+      CHECK(uthread_join(tids[i], nullptr) == 0);
+    }
+  CHECK(woken == COND_WAITERS);
+
+  int tid = uthread_spawn_arg(wait_for_token, &other_mutex);
+  WAIT_UNTIL(waiters_entered(&other_mutex) == COND_WAITERS + 1);
+  CHECK(cond.mutex == &other_mutex);
+  CHECK(uthread_mutex_lock(&cond_mutex) == 0);
+  CHECK(uthread_cond_wait(&cond, &cond_mutex) == -1);
+  CHECK(uthread_mutex_unlock(&cond_mutex) == 0);
+  signal_waiter(&other_mutex, tid);
+  CHECK(cond.mutex == nullptr);
+
+  // A terminated waiter unbinds the condition variable too when it was the last one.
+  tid = uthread_spawn_arg(wait_for_token, &cond_mutex);
+  WAIT_UNTIL(waiters_entered(&cond_mutex) == COND_WAITERS + 2);
+  CHECK(cond.mutex == &cond_mutex);
+  CHECK(uthread_terminate(tid) == 0);
+  CHECK(cond.mutex == nullptr);
+  CHECK(peek(cond.waiters.head) == -1);
+  CHECK(uthread_join(tid, nullptr) == 0);
+  tid = uthread_spawn_arg(wait_for_token, &other_mutex);
+  WAIT_UNTIL(waiters_entered(&other_mutex) == COND_WAITERS + 3);
+  CHECK(cond.mutex == &other_mutex);
+  signal_waiter(&other_mutex, tid);
+  CHECK(woken == COND_WAITERS + 2);
+}
+
+
+static void *lock_and_unlock(void *mutex) {
+  CHECK(uthread_mutex_lock(static_cast<uthread_mutex *>(mutex)) == 0);
+  CHECK(uthread_mutex_unlock(static_cast<uthread_mutex *>(mutex)) == 0);
+  return nullptr;
+}
+
+static void test_mutex_terminate_waiter() {
+  uthread_mutex mutex;
+  CHECK(uthread_mutex_init(&mutex) == 0);
+  CHECK(uthread_mutex_lock(&mutex) == 0);
+  int first = uthread_spawn_arg(lock_and_unlock, &mutex);
+  WAIT_UNTIL(peek(mutex.waiters.tail) == first);
+  int second = uthread_spawn_arg(lock_and_unlock, &mutex);
+  WAIT_UNTIL(peek(mutex.waiters.tail) == second);
+  CHECK(uthread_terminate(first) == 0);
+  CHECK(peek(mutex.waiters.head) == second);
+  CHECK(uthread_terminate(second) == 0);
+  CHECK(peek(mutex.waiters.head) == -1);
+  // Nobody is left to hand the mutex to.
+  CHECK(uthread_mutex_unlock(&mutex) == 0);
+  CHECK(peek(mutex.owner) == -1);
+  CHECK(uthread_join(first, nullptr) == 0);
+  CHECK(uthread_join(second, nullptr) == 0);
+}
+
+
+static uthread_rwlock rwlock = UTHREAD_RWLOCK_INITIALIZER;
+static uthread_sem rw_release = UTHREAD_SEM_INITIALIZER(0);
+static std::atomic<int> reading{0};
+
+/* Holds rwlock for reading until rw_release is posted. */
+static void *read_locked(void *) {
+  CHECK(uthread_rwlock_rdlock(&rwlock) == 0);
+  reading++;
+  CHECK(uthread_sem_wait(&rw_release) == 0);
+  reading--;
+  CHECK(uthread_rwlock_unlock(&rwlock) == 0);
+  return nullptr;
+}
+
+/* Holds rwlock for writing until rw_release is posted. */
+static void *write_locked(void *) {
+  CHECK(uthread_rwlock_wrlock(&rwlock) == 0);
+  CHECK(uthread_sem_wait(&rw_release) == 0);
+  CHECK(uthread_rwlock_unlock(&rwlock) == 0);
+  return nullptr;
+}
+
+static void test_rwlock_writer_preference() {
+  CHECK(uthread_rwlock_rdlock(&rwlock) == 0);
+  int writer = uthread_spawn_arg(write_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.write_waiters.head) == writer);
+  // Readers arriving after a waiting writer park behind it, although the lock is only held for reading.
+  int first_reader = uthread_spawn_arg(read_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.read_waiters.head) == first_reader);
+  int second_reader = uthread_spawn_arg(read_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.read_waiters.tail) == second_reader);
+  CHECK(peek(rwlock.readers) == 1);
+
+  CHECK(uthread_rwlock_unlock(&rwlock) == 0);
+  CHECK(peek(rwlock.writer) == writer);
+  int next_writer = uthread_spawn_arg(write_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.write_waiters.head) == next_writer);
+  WAIT_UNTIL(peek(rw_release.waiters.head) == writer);
+
+  // The writer hands the lock to all the readers that waited, before the next writer.
+  CHECK(uthread_sem_post(&rw_release) == 0);
+  WAIT_UNTIL(reading == 2);
+  CHECK(peek(rwlock.readers) == 2);
+  CHECK(peek(rwlock.writer) == -1);
+  CHECK(peek(rwlock.write_waiters.head) == next_writer);
+  CHECK(uthread_sem_post(&rw_release) == 0);
+  CHECK(uthread_sem_post(&rw_release) == 0);
+  WAIT_UNTIL(peek(rwlock.writer) == next_writer);
+  CHECK(uthread_sem_post(&rw_release) == 0);
+  CHECK(uthread_join(writer, nullptr) == 0);
+  CHECK(uthread_join(first_reader, nullptr) == 0);
+  CHECK(uthread_join(second_reader, nullptr) == 0);
+  CHECK(uthread_join(next_writer, nullptr) == 0);
+  CHECK(peek(rwlock.writer) == -1);
+  CHECK(peek(rwlock.readers) == 0);
+}
+
+static void test_rwlock_terminate_writer() {
+  CHECK(uthread_rwlock_rdlock(&rwlock) == 0);
+  int writer = uthread_spawn_arg(write_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.write_waiters.head) == writer);
+  int reader = uthread_spawn_arg(read_locked, nullptr);
+  WAIT_UNTIL(peek(rwlock.read_waiters.head) == reader);
+  // Without the writer it waited behind, the reader joins the one holding the lock.
+  CHECK(uthread_terminate(writer) == 0);
+  CHECK(peek(rwlock.write_waiters.head) == -1);
+  WAIT_UNTIL(reading == 1);
+  CHECK(peek(rwlock.readers) == 2);
+  CHECK(uthread_sem_post(&rw_release) == 0);
+  CHECK(uthread_join(reader, nullptr) == 0);
+  CHECK(uthread_join(writer, nullptr) == 0);
+  CHECK(uthread_rwlock_unlock(&rwlock) == 0);
+  CHECK(peek(rwlock.readers) == 0);
+  CHECK(uthread_rwlock_wrlock(&rwlock) == 0);
+  CHECK(uthread_rwlock_unlock(&rwlock) == 0);
+}
+
+
+int main(int argc, char **argv) {
+  init_test(argc, argv);
+  test_mutex_contention();
+  test_mutex_handoff();
+  test_sem();
+  test_cond();
+  test_mutex_terminate_waiter();
+  test_rwlock_writer_preference();
+  test_rwlock_terminate_writer();
+  uthread_terminate(0);
+}
@@ -0,0 +1,56 @@
+/*
+ * Helpers shared by the behaviour tests of the uthreads library. Each test is a program run by ctest as
+ *   <test> [num_workers]
+ * which exits with 0 when all its checks pass, and otherwise reports the first failing check and exits with 1.
+ */
+#ifndef _UTHREADS_TEST_UTILS_H
+#define _UTHREADS_TEST_UTILS_H
+
+#include "uthreads.h"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#define QUANTUM_USECS 1000
+#define WAIT_LIMIT_SECS 10 /* how long WAIT_UNTIL waits before it fails the test */
+
+#define CHECK(condition) \
+  do { \
+      if (!(condition)) { \
+          fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+          exit(1); \
+        } \
+    } while (0)
+
+/* Yields until condition holds, failing the test if it does not within WAIT_LIMIT_SECS. */
+#define WAIT_UNTIL(condition) \
+  do { \
+      time_t wait_start = time(NULL); \
+      while (!(condition)) { \
+          CHECK(time(NULL) - wait_start < WAIT_LIMIT_SECS); \
+          uthread_yield(); \
+        } \
+    } while (0)
+
+/* Initializes the library with the number of workers given on the command line, 1 by default, and returns it. */
+inline int init_test(int argc, char **argv) {
+  int num_workers = argc > 1 ? atoi(argv[1]) : 1;
+  CHECK(num_workers >= 1);
+  CHECK((num_workers == 1 ? uthread_init(QUANTUM_USECS) : uthread_init_workers(QUANTUM_USECS, num_workers)) == 0);
+  return num_workers;
+}
+
+/* Reads a field of a library object that threads on other workers may change, such as the owner of a mutex or the
+   tail of a wait queue. */
+inline int peek(const int &field) {
+  return __atomic_load_n(&field, __ATOMIC_ACQUIRE);
+}
+
+/* Returns the number of times the thread with ID tid gave up the CPU, which grows when it parks. */
+inline unsigned long long voluntary_switches(int tid) {
+  uthread_stats stats;
+  CHECK(uthread_get_stats(tid, &stats) == 0);
+  return stats.voluntary_switches;
+}
+
+#endif //_UTHREADS_TEST_UTILS_H
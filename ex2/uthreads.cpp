@@ -1,476 +1,5149 @@
 #include "uthreads.h"
-#include <set>
-#include <unordered_map>
-#include <list>
 #include <csignal>
+#include <cstdint>
 #include <sys/time.h>
-#include <csetjmp>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sched.h>
+#include <ctime>
+#include <cerrno>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
 #include <stdio.h>
 #include <iostream>
+#include <vector>
+#include <new>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
 
-#define JB_SP 6
-#define JB_PC 7
 #define READY 1
 #define RUNNING 2
 #define BLOCKED 3
-#define USED 1
-#define UNUSED 0
+#define NO_TID (-1)
+#define NO_TIMER (-1)
+#define CACHE_LINE 64
+#define TID_WORD_BITS 64
+#define TID_WORDS ((MAX_THREAD_NUM + TID_WORD_BITS - 1) / TID_WORD_BITS)
+#define TABLE_CHUNK 1024 /* thread control blocks allocated at a time */
+#define TABLE_CHUNKS ((MAX_THREAD_NUM + TABLE_CHUNK - 1) / TABLE_CHUNK)
+#define STACK_CANARY 0x7574687265616473ULL /* written at the lowest word of every stack that has no guard page */
+#define DEFAULT_MAX_MAP_COUNT 65530
+#define MLFQ_BOOST_PERIOD 64 /* quantums between two priority boosts of the MLFQ policy */
+#define FAIR_NICE_0_WEIGHT 1024 /* weight of UTHREAD_PRIO_DEFAULT under the fair policy */
+#define BANDWIDTH_SHIFT 20 /* fixed point of deadline bandwidths, runtime / deadline */
+#define MAX_DEADLINE_BANDWIDTH ((95ULL << BANDWIDTH_SHIFT) / 100) /* left to the other threads: 5% */
+
+/* keys of a thread heap */
+#define HEAP_BY_WAKE_AT 0
+#define HEAP_BY_VRUNTIME 1
+#define HEAP_BY_DEADLINE 2
+
+/* reasons for a forced switch */
+#define SWITCH_YIELD 0 /* the running thread goes to the back of the ready queue */
+#define SWITCH_PREEMPT 1 /* a thread of higher priority became ready, the running thread goes to the front */
+#define SWITCH_BLOCK 2
+#define SWITCH_SLEEP 3 /* for a number of quantums */
+#define SWITCH_SLEEP_USECS 4 /* for a number of micro-seconds */
+#define SWITCH_TERMINATE 5
+#define SWITCH_WAIT_PERIOD 6 /* a deadline thread waits for its next period */
+#define SWITCH_PARK 7 /* the running thread waits on the wait queue of a synchronization object */
+
+/* events of the scheduler trace, recorded when the library is built with UTHREADS_TRACE defined */
+#define TRACE_RUN 0 /* the worker starts running the thread, or idles if the tid is NO_TID */
+#define TRACE_SPAWN 1
+#define TRACE_BLOCK 2 /* blocked by uthread_block */
+#define TRACE_PARK 3 /* waits on a synchronization object, a channel, a file descriptor or a join */
+#define TRACE_RESUME 4
+#define TRACE_SLEEP 5
+#define TRACE_WAKE 6 /* a sleeper is due, or a parked thread is released */
+#define TRACE_EXIT 7
+#define TRACE_EVENTS (1 << 16) /* events kept per worker, a power of two */
+
+/* flags of a thread control block */
+#define FLAG_USED 0x1
+#define FLAG_BLOCKED 0x2 /* blocked by uthread_block */
+#define FLAG_SLEEPING 0x4 /* blocked by uthread_sleep / uthread_sleep_usecs */
+#define FLAG_TIMED_SLEEP 0x8 /* the sleep is measured in wall-clock time */
+#define FLAG_THROTTLED 0x10 /* sleeps until the next period of its deadline reservation or of a group quota */
+#define FLAG_CANCELLED 0x20 /* terminated while running on another worker, it exits at its next switch */
+#define FLAG_PINNED 0x40 /* moved by uthread_migrate, work stealing leaves it on its worker */
+#define FLAG_WAITING 0x80 /* parked on the wait queue of a mutex, condition variable, semaphore or rwlock */
+#define FLAG_SELECTING 0x100 /* parked on one or more channels */
+#define FLAG_IO 0x200 /* parked, with FLAG_WAITING, until a file descriptor is ready */
+#define FLAG_JOINABLE 0x400 /* spawned by uthread_spawn_arg, its exit value is kept until it is joined */
+#define FLAG_EXITED 0x800 /* a joinable thread that finished and was not joined yet, only its tid and value remain */
+#define FLAG_TASK 0x1000 /* a stackless coroutine, run by the scheduling loop of a worker, see run_task */
+#define FLAG_LOCAL_DATA 0x2000 /* has LocalData, kept in place of the entry point once the thread started */
+#define FLAG_DYING 0x4000 /* a task whose frame the thread that terminated it destroys, no longer a live thread */
+#define FLAG_COND_WAIT 0x8000 /* parked, with FLAG_WAITING, on the wait queue of a condition variable */
+#define FLAG_UNGUARDED 0x10000 /* its stack has no guard page, and carries STACK_CANARY instead */
+#define FLAG_WRITE_WAIT 0x20000 /* parked, with FLAG_WAITING, on the writer queue of a rwlock */
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* State of the worker (kernel thread) that runs the code. With the initial-exec model every access goes through %fs,
+   so a uthread that moved to another worker always sees the state of the worker it now runs on. */
+#define WORKER_LOCAL thread_local __attribute__((tls_model("initial-exec")))
+#define NSECS_PER_USEC 1000ULL
+#define NSECS_PER_SEC 1000000000ULL
+#define INITIAL_MXCSR 0x1F80 /* all SSE exceptions masked, round to nearest */
+#define INITIAL_FPU_CW 0x037F /* x87 defaults, as set by finit */
+#define POOL_BUCKETS 8 /* number of distinct stack sizes the pool caches */
+#define ARENA_CHUNK_SIZE 65536 /* arenas map memory in chunks aligned to their size, see ArenaChunk */
+#define ARENA_MIN_BLOCK 16
+#define ARENA_CLASSES 10 /* blocks of 16 to 8192 bytes */
+#define ARENA_LARGE ARENA_CLASSES /* size class of a chunk that holds a single larger block */
+#define ARENA_CHUNK_CACHE 64 /* free chunks kept mapped for the next arenas */
+#define RESIDENCY_PAGES 64 /* pages of a stack checked by one call of mincore */
+#define GROUP_PICK_ATTEMPTS 64 /* threads of groups ahead of their share passed over at most, per pick */
+#define MAX_WORKERS 256
+#define IDLE_STACK_SIZE 65536 /* stack of the scheduling loop of the first worker */
+#define DEQUE_INITIAL_CAPACITY 64
+#define IDLE_MIN_BACKOFF_NSECS 10000 /* an idle worker looks for work to steal at least that often, with several */
+#define IDLE_MAX_BACKOFF_NSECS 1000000
+#define LOCK_SPINS 128 /* spins on the scheduler lock before yielding the CPU */
+#define INTERACTIVITY_SCALE 1024 /* fixed point of the share of switches made by threads giving up the CPU */
+#define INTERACTIVITY_SHIFT 3 /* each switch moves the average by 1/8 of the way */
+#define NO_LIMIT (-1)
 
 
 // --- thread class Declaration ---
 
-class Thread {
+class ThreadQueue;
+struct ChanSelect;
+
+/* Reservation of a deadline thread, all times in nanoseconds, within one cache line. Allocated only for threads in
+   the deadline class, so the control block only holds a pointer to it. */
+struct DeadlineParams {
+  uint64_t runtime;
+  uint64_t deadline; // relative to the start of a period
+  uint64_t period;
+  uint64_t bandwidth; // runtime / deadline, in BANDWIDTH_SHIFT fixed point
+  uint64_t abs_deadline; // deadline of the current period
+  int64_t budget; // runtime left in the current period
+};
+
+static_assert(sizeof(DeadlineParams) <= CACHE_LINE, "a deadline reservation must fit a cache line");
+
+/* Join state of a thread, allocated for the threads spawned with uthread_spawn_arg and for the threads that join or
+   are joined, so the others keep their blocks unchanged. */
+struct JoinState {
+  thread_arg_entry_point entry_point;
+  void *arg; // argument of entry_point, kept apart so a thread terminated before it starts exits with NULL
+  void *value; // exit value
+  ThreadQueue *joiners; // threads parked in uthread_join until the thread finishes
+  void **join_into; // where the pending uthread_join of the thread itself stores the value it waits for
+};
+
+/* Header of a chunk of an arena. Chunks are aligned to ARENA_CHUNK_SIZE, so the chunk of a block is found by rounding
+   its address down. A chunk holds blocks of a single size class, or a single block larger than all of them. */
+struct alignas(CACHE_LINE) ArenaChunk {
+  ArenaChunk *next; // chunks of the same arena, or of the cache
+  ArenaChunk *prev;
+  size_t size; // bytes mapped, the header included
+  int size_class;
+  int owner; // tid whose arena holds the chunk, NO_TID for the library
+};
+
+/* Memory allocator of a thread, or of the library. Blocks are bumped out of the chunk of their size class and
+   recycled through a free list per class, and all the chunks are released at once with the arena. */
+struct Arena {
+  ArenaChunk *chunks;
+  char *bump[ARENA_CLASSES];
+  char *end[ARENA_CLASSES];
+  void *free_lists[ARENA_CLASSES]; // linked through their first word
+};
+
+void *pool_alloc(size_t size);
+
+void pool_free(void *block);
+
+/* Growable array of trivially copyable items in the library arena. It stands in for a std::vector wherever the
+   critical section grows one, so that the critical section never calls into malloc. Grown and freed in the critical
+   section only. */
+template <typename T>
+class PoolVector {
+ private:
+  T *items = nullptr;
+  size_t count = 0;
+  size_t capacity = 0;
+
+  void reserve(size_t new_capacity) {
+    T *bigger = (T *) pool_alloc(new_capacity * sizeof(T));
+    if (count > 0) {
+        memcpy(bigger, items, count * sizeof(T));
+      }
+    pool_free(items);
+    items = bigger;
+    capacity = new_capacity;
+  }
+
+ public:
+  PoolVector() = default;
+
+  PoolVector(const PoolVector &other) = delete;
+
+  PoolVector &operator=(const PoolVector &other) = delete;
+
+  ~PoolVector() { pool_free(items); }
+
+  bool empty() const { return count == 0; }
+
+  size_t size() const { return count; }
+
+  T &operator[](size_t index) { return items[index]; }
+
+  const T &operator[](size_t index) const { return items[index]; }
+
+  T &back() { return items[count - 1]; }
+
+  void pop_back() { count--; }
+
+  void push_back(T item) {
+    if (count == capacity) {
+        reserve(capacity == 0 ? 16 : capacity * 2);
+      }
+    items[count++] = item;
+  }
+
+  void resize(size_t new_size, T fill) {
+    if (new_size > capacity) {
+        reserve(new_size > capacity * 2 ? new_size : capacity * 2);
+      }
+    for (size_t i = count; i < new_size; i++) {
+        items[i] = fill;
+      }
+    count = new_size;
+  }
+};
+
+/* Data that only its thread uses, created on its first use. */
+struct LocalData {
+  PoolVector<void *> specific; // indexed by uthread_key
+  Arena arena;
+};
+
+
+/* Scheduling statistics of a thread, on two cache lines of their own. They live beside the control blocks, in a table
+   of their own, so a block keeps to its two cache lines. */
+struct alignas(CACHE_LINE) ThreadStats {
+  uint64_t since; // when the thread entered its current state
+  uint64_t ready_wait_nsecs;
+  uint64_t sleep_nsecs;
+  uint64_t block_nsecs;
+  uint64_t voluntary_switches;
+  uint64_t involuntary_switches;
+  uint64_t max_latency_nsecs;
+  uint32_t latency_histogram[UTHREAD_LATENCY_BUCKETS];
+};
+
+static_assert(sizeof(ThreadStats) == 2 * CACHE_LINE and alignof(ThreadStats) == CACHE_LINE,
+              "the statistics of a thread must take two cache lines");
+
+/* Statistics of the whole scheduler. */
+struct SchedStats {
+  uint64_t voluntary_switches;
+  uint64_t involuntary_switches;
+  uint64_t ready_wait_nsecs;
+  uint64_t max_latency_nsecs;
+  uint64_t idle_nsecs;
+  uint64_t latency_histogram[UTHREAD_LATENCY_BUCKETS];
+  int by_state[BLOCKED + 1]; // threads in each state, index 0 unused
+};
+
+
+/* Thread control block. All the blocks live in one flat table indexed by tid, each one on two cache lines of its
+   own, so a scheduling decision only touches the blocks of the threads involved. */
+class alignas(CACHE_LINE) Thread {
+  friend class ThreadQueue;
+  friend class ThreadHeap;
  private:
   int tid;
   int quantums_counter;
   int state;
-  char stack[STACK_SIZE];
-  thread_entry_point entryPoint;
+  int flags;
+  int heap_index; // position in the sleep heap while sleeping
+  int next; // next tid in the ready queue
+  int prev; // previous tid in the ready queue
+  int running_on; // worker running the thread, while RUNNING
+  int8_t priority; // effective priority, moved by the MLFQ feedback
+  int8_t base_priority; // priority set by the user
+  uint16_t group; // thread group, see Group
+  uint32_t stack_size; // stacks are sized by an int
+  uint64_t wake_at; // absolute wake-up time of a sleeping thread, in quantums or in nanoseconds
+  uint64_t vruntime; // weighted nanoseconds of CPU time, for the fair policy
+  uint64_t run_start; // when the thread last started running
+  uint64_t runtime; // nanoseconds the thread ran, up to run_start
+  void *sp; // saved stack pointer while the thread is switched out, the coroutine to resume for a task
+  union {
+    char *stack; // lowest usable address of the stack, just above its guard page
+    void *frame; // coroutine frame of a task, which has no stack
+  };
+  union {
+    thread_entry_point entryPoint; // until the thread starts
+    LocalData *local; // with FLAG_LOCAL_DATA
+  };
+  DeadlineParams *dl; // nullptr unless the thread is in the deadline class
+  uint32_t queue_seq; // bumped on every push to a work deque, older entries of the thread are stale
+  int worker; // worker whose deque the thread is queued on
+  JoinState *join; // nullptr unless the thread joins, is joined or was spawned by uthread_spawn_arg
+  union {
+    ThreadQueue *wait_queue; // queue the thread is parked on, while FLAG_WAITING
+    ChanSelect *select; // channel operations the thread is parked on, while FLAG_SELECTING
+  };
 
  public:
-  Thread(int tid, thread_entry_point entryPoint);
+  Thread() = default;
+
+  Thread(const Thread &other) = delete;
+  Thread &operator=(const Thread &other) = delete;
 
-  ~Thread();
+  void init(int tid, thread_entry_point entryPoint, char *stack, size_t stack_size);
 
-  Thread(const Thread &other); // copy constructor
-  Thread &operator=(const Thread &other); // copy assignment
   int get_tid() const;
 
   int get_state() const;
 
   int get_thread_quantums() const;
 
-  void increment_quantums();
+  void increment_quantums();
+
+  void set_state(int);
+
+  bool has_flag(int flag) const;
+
+  void set_flag(int flag);
+
+  void clear_flag(int flag);
+
+  uint64_t get_wake_at() const;
+
+  void set_wake_at(uint64_t);
+
+  int get_priority() const;
+
+  void set_priority(int);
+
+  int get_base_priority() const;
+
+  void set_base_priority(int);
+
+  int get_group() const;
+
+  void set_group(int);
+
+  uint64_t get_vruntime() const;
+
+  void set_vruntime(uint64_t);
+
+  uint64_t get_run_start() const;
+
+  void set_run_start(uint64_t);
+
+  uint64_t get_runtime() const;
+
+  void add_runtime(uint64_t);
+
+  char *get_stack() const;
+
+  size_t get_stack_size() const;
+
+  void *get_frame() const;
+
+  void set_frame(void *);
+
+  thread_entry_point get_entry_point() const;
+
+  LocalData *get_local() const;
+
+  void set_local(LocalData *);
+
+  DeadlineParams *get_deadline() const;
+
+  void set_deadline(DeadlineParams *);
+
+  JoinState *get_join() const;
+
+  void set_join(JoinState *);
+
+  uint32_t get_queue_seq() const;
+
+  void bump_queue_seq();
+
+  int get_worker() const;
+
+  void set_worker(int);
+
+  int get_running_on() const;
+
+  void set_running_on(int);
+
+  ThreadQueue *get_wait_queue() const;
+
+  void set_wait_queue(ThreadQueue *);
+
+  ChanSelect *get_select() const;
+
+  void set_select(ChanSelect *);
+
+  void **get_context();
+};
+
+static_assert(sizeof(Thread) == 2 * CACHE_LINE and alignof(Thread) == CACHE_LINE,
+              "a control block must take two cache lines");
+
+
+/* FIFO queue of tids, linked through the next / prev fields of the thread table. A thread is a member of at most
+   one queue at a time, so insertion and removal never allocate. */
+class ThreadQueue {
+ private:
+  int head = NO_TID;
+  int tail = NO_TID;
+
+ public:
+  bool empty() const { return head == NO_TID; }
+
+  int front() const { return head; }
+
+  void push_back(int tid);
+
+  void push_front(int tid);
+
+  int pop_front();
+
+  void remove(int tid);
+};
+
+/* The wait queue of a synchronization object is a thread queue, which the header declares with the same layout. */
+static_assert(sizeof(ThreadQueue) == sizeof(uthread_wait_queue), "wait queues must have the layout of a ThreadQueue");
+
+
+/* Binary min-heap of tids, keyed either by the absolute wake-up time of sleepers or by the virtual runtime of READY
+   threads. A thread is in at most one heap and records its position there, so the minimum is found in O(1) and a
+   thread can be removed without a search. */
+class ThreadHeap {
+ private:
+  PoolVector<int> heap;
+  int key_kind;
+
+  uint64_t key(int tid) const;
+
+  void place(int index, int tid);
+
+  void sift_up(int index);
+
+  void sift_down(int index);
+
+ public:
+  explicit ThreadHeap(int key_kind) : key_kind(key_kind) {}
+
+  bool empty() const { return heap.empty(); }
+
+  int top() const { return heap[0]; }
+
+  void push(int tid);
+
+  void remove(int tid);
+};
+
+
+/* Chase-Lev work-stealing deque of (queue_seq, tid) entries. Pushes go to the bottom and must not run concurrently
+   with each other; they are serialized by the scheduler lock. Entries are taken from the top with a compare and
+   swap, by the owner worker, which keeps its threads in FIFO order, and by the other workers: with the lock held
+   from a scheduling decision, or without it from the scheduling loop of an idle worker, see steal_unlocked. The
+   entries themselves are only checked against the thread table under the lock. Arrays are mapped apart from the
+   library arena, and an array a push replaced stays mapped until no taker without the lock may still read it. */
+class WorkDeque {
+ private:
+  struct Array {
+    int64_t capacity;
+    size_t mapped; // bytes mapped, the slots included
+    Array *replaced; // next array of the retired list
+    std::atomic<uint64_t> *slots; // right after the array, in the same mapping
+  };
+  alignas(CACHE_LINE) std::atomic<int64_t> top{0};
+  alignas(CACHE_LINE) std::atomic<int64_t> bottom{0};
+  std::atomic<Array *> array{nullptr};
+  Array *retired = nullptr; // replaced arrays still mapped, touched by pushes only
+  alignas(CACHE_LINE) std::atomic<int> unlocked_takers{0}; // inside steal_unlocked
+
+  static Array *new_array(int64_t capacity);
+
+  Array *grow(Array *old, int64_t top_index, int64_t bottom_index);
+
+  void release_retired();
+
+ public:
+  bool empty() const { return top.load(std::memory_order_acquire) >= bottom.load(std::memory_order_acquire); }
+
+  int64_t size() const { return bottom.load(std::memory_order_acquire) - top.load(std::memory_order_acquire); }
+
+  void push(uint64_t entry);
+
+  bool steal(uint64_t &entry);
+
+  bool steal_unlocked(uint64_t &entry);
+};
+
+
+/* Ticket lock. With several workers it protects all the scheduler state; it is only ever taken inside a critical
+   section, so the timer handler never spins on a lock held by its own worker. Tickets are served in order, so a
+   worker that switches threads in a tight loop cannot keep the others out, and a waiter gives its CPU away after a
+   while in case the holder was descheduled. */
+class SpinLock {
+ private:
+  alignas(CACHE_LINE) std::atomic<uint32_t> next_ticket{0};
+  alignas(CACHE_LINE) std::atomic<uint32_t> now_serving{0};
+
+ public:
+  void lock() {
+    uint32_t ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+    for (int spins = 0; now_serving.load(std::memory_order_acquire) != ticket; spins++) {
+        if (spins < LOCK_SPINS) {
+            __builtin_ia32_pause();
+          } else {
+            sched_yield();
+          }
+      }
+  }
+
+  void unlock() { now_serving.store(now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+};
+
+
+/* READY threads. Under the priority policies, one FIFO queue per priority level, and a bitmap of the non-empty
+   levels finds the highest one in O(1); with a single level in use this is plain round robin. Under the fair policy,
+   a heap ordered by virtual runtime. Deadline threads come before all of them, in a heap ordered by absolute
+   deadline. With several workers, the work deque of each thread's worker instead, with round robin inside a
+   worker. */
+class ReadyQueue {
+ private:
+  ThreadQueue levels[UTHREAD_PRIO_LEVELS];
+  unsigned int non_empty = 0;
+  ThreadHeap by_vruntime{HEAP_BY_VRUNTIME};
+  ThreadHeap by_deadline{HEAP_BY_DEADLINE};
+  bool fair = false;
+  bool distributed = false;
+  int count = 0;
+
+  int top_priority() const { return 31 - __builtin_clz(non_empty); }
+
+  int claim(uint64_t entry);
+
+  int take_from(int victim);
+
+  int pop_distributed();
+
+ public:
+  void set_fair(bool is_fair) { fair = is_fair; }
+
+  void set_distributed(bool is_distributed) { distributed = is_distributed; }
+
+  bool is_distributed() const { return distributed; }
+
+  bool empty() const;
+
+  int size() const;
+
+  int front() const;
+
+  void push_back(int tid);
+
+  void push_front(int tid);
+
+  int pop_front();
+
+  void remove(int tid);
+
+  void boost();
+
+  bool steal_unlocked(uint64_t &entry);
+
+  void adopt(uint64_t entry);
+};
+
+
+/* Thread table indexed by tid. It grows one chunk at a time as tids are handed out, and chunks never move, so a
+   reference to a control block stays valid while the table grows. */
+class ThreadTable {
+ private:
+  Thread *chunks[TABLE_CHUNKS] = {};
+  ThreadStats *stats_chunks[TABLE_CHUNKS] = {};
+  int num_chunks = 0;
+
+ public:
+  Thread &operator[](int tid) { return chunks[tid / TABLE_CHUNK][tid % TABLE_CHUNK]; }
+
+  ThreadStats &stats(int tid) { return stats_chunks[tid / TABLE_CHUNK][tid % TABLE_CHUNK]; }
+
+  int capacity() const { return num_chunks * TABLE_CHUNK; }
+
+  size_t allocated_bytes() const {
+    return (size_t) num_chunks * TABLE_CHUNK * (sizeof(Thread) + sizeof(ThreadStats));
+  }
+
+  void grow();
+};
+
+
+/* Cache of stacks released by terminated threads, kept mapped so that spawning a thread does not go through mmap.
+   Free stacks are grouped by size and linked through a pointer stored at their top, a page the previous owner has
+   already committed, next to whether the stack has a guard page. */
+class StackPool {
+ private:
+  struct Bucket {
+    size_t stack_size;
+    char *head;
+  };
+  Bucket buckets[POOL_BUCKETS] = {};
+  int cached = 0;
+  int limit = NO_LIMIT;
+
+  static char *&next_of(char *stack, size_t stack_size);
+
+  static bool &guarded_of(char *stack, size_t stack_size);
+
+ public:
+  int get_cached() const { return cached; }
+
+  void set_limit(int new_limit) { limit = new_limit; }
+
+  char *take(size_t stack_size, bool &guarded);
+
+  bool give(char *stack, size_t stack_size, bool guarded);
+
+  int trim(int keep);
+};
+
+
+
+// --- Data structures and general functions ---
+
+ThreadTable threads; // key is tid
+SchedStats sched_stats;
+uint64_t used_tids[TID_WORDS]; // bit is set iff the tid is in use
+int first_free_word = 0; // no word below it has a free tid
+int num_threads = 0;
+size_t mapped_stack_bytes = 0;
+long mapped_stacks = 0;
+long max_guarded_stacks; // a guard page splits the stack mapping in two, so guards are only used up to this count
+ReadyQueue ready_q;
+ThreadHeap quantum_sleepers{HEAP_BY_WAKE_AT}; // keyed by the quantum in which the thread wakes up
+ThreadHeap timed_sleepers{HEAP_BY_WAKE_AT}; // keyed by CLOCK_MONOTONIC nanoseconds
+StackPool stack_pool;
+
+/* One event of the scheduler trace, timestamped with the TSC. */
+struct TraceEvent {
+  uint64_t tsc;
+  int tid;
+  int type; // TRACE_*
+};
+
+/* A kernel thread running uthreads. By default the thread that called uthread_init is the only worker and none of
+   this is used. */
+struct Worker {
+  WorkDeque deque; // READY threads of this worker
+  pthread_t pthread;
+  timer_t timer; // quantum timer, unless the single worker uses ITIMER_VIRTUAL
+  int timer_source = NO_TIMER; // UTHREAD_TIMER_* source the timer was created for
+  void *idle_sp; // context of the scheduling loop, which runs while the worker has nothing to do
+#ifdef UTHREADS_TRACE
+  TraceEvent *trace = nullptr; // ring of the last TRACE_EVENTS events of this worker, written by it alone
+  uint64_t trace_head = 0; // events recorded so far
+#endif
+};
+Worker *workers = nullptr;
+int num_workers = 1;
+SpinLock sched_lock; // held, with several workers, by whichever worker is inside a critical section
+std::atomic<uint32_t> waits_started{0}; // see note_new_wait
+
+WORKER_LOCAL int worker_index = 0;
+WORKER_LOCAL int running_thread; // NO_TID while the worker idles
+
+/* Every event is recorded inside the critical section, by the worker it happened on, into the ring of that worker,
+   so recording takes no lock and no atomic operation: a TSC read and a store. Without UTHREADS_TRACE the calls
+   compile to nothing. */
+#ifdef UTHREADS_TRACE
+uint64_t trace_start_tsc; // TSC and CLOCK_MONOTONIC when tracing started, to convert TSC ticks to time
+uint64_t trace_start_nsecs;
+
+inline void trace_event(int type, int tid) {
+  Worker &worker = workers[worker_index];
+  TraceEvent &event = worker.trace[worker.trace_head++ & (TRACE_EVENTS - 1)];
+  event.tsc = __builtin_ia32_rdtsc();
+  event.tid = tid;
+  event.type = type;
+}
+
+#define TRACE(type, tid) trace_event(type, tid)
+#else
+#define TRACE(type, tid) ((void) 0)
+#endif
+
+void timed_switch(int);
+
+void on_timer_signal(int, siginfo_t *, void *);
+
+void close_program();
+
+void destroy_coroutine(void *address);
+
+void run_specific_destructors();
+
+int total_quantum_num;
+typedef unsigned long address_t;
+size_t page_size;
+
+/* A thread that terminates itself is still running on its stack, so the stack is only released by the thread that
+   runs after it. */
+WORKER_LOCAL char *dead_stack = nullptr;
+WORKER_LOCAL size_t dead_stack_size = 0;
+WORKER_LOCAL bool dead_stack_guarded = true;
+
+/* The timer handler never interrupts the library in the middle of an update: while in_critical_section is set a
+   quantum expiry is only recorded, and the preemption happens when the section is left. */
+WORKER_LOCAL volatile sig_atomic_t in_critical_section = 0;
+WORKER_LOCAL volatile sig_atomic_t preemption_pending = 0;
+WORKER_LOCAL volatile sig_atomic_t reschedule_pending = 0; // a thread of higher priority than the running one became ready
+
+/* The quantum timer is periodic, so a period that expired has already started the next one. tick_start is when the
+   current period started, 0 while it is not a whole quantum, and tick_length is the period. */
+WORKER_LOCAL volatile uint64_t tick_start = 0;
+WORKER_LOCAL uint64_t tick_length = 0;
+WORKER_LOCAL bool timer_stopped = false; // the quantum timer of this worker is stopped, see Scheduler::stop_timer
+
+/* A task runs outside the critical section but is never preempted, see run_task. */
+WORKER_LOCAL bool task_running = false;
+WORKER_LOCAL int next_task = NO_TID; // task chosen by a switch, handed over to the scheduling loop
+
+void forced_switch(int reason, long amount = 0);
+
+bool outranks(int tid, int other);
+
+void count_runnable(int tid, bool was_runnable, bool is_runnable);
+
+void charge_group(int tid, uint64_t ran);
+
+uint64_t group_quota_left(int tid);
+
+uint64_t group_throttled_until(int tid);
+
+
+/* With several workers the scheduler lock is taken too. It stays held across a context switch and is released by the
+   context that runs next, when it leaves the critical section. */
+void enter_critical_section() {
+  in_critical_section = 1;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (num_workers > 1) {
+      sched_lock.lock();
+    }
+}
+
+void leave_critical_section() {
+  if (num_workers > 1) {
+      sched_lock.unlock();
+    }
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  in_critical_section = 0;
+  std::atomic_signal_fence(std::memory_order_seq_cst);
+  if (task_running) {
+      return;
+    }
+  if (preemption_pending) {
+      timed_switch(SIGVTALRM);
+    } else if (reschedule_pending) {
+      enter_critical_section();
+      forced_switch(SWITCH_PREEMPT);
+    }
+}
+
+
+/* Tells the idle workers, which look for work without the lock, that a thread started to sleep or to wait for a
+   descriptor, which the timeout they wait for may not account for. Called in the critical section. */
+void note_new_wait() {
+  if (num_workers > 1) {
+      waits_started.store(waits_started.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+}
+
+
+/* Saves the callee-saved registers and the SSE / x87 control words of the running context on its stack, stores its
+   stack pointer in *save_sp and resumes the context whose stack pointer is load_sp. Unlike sigsetjmp / siglongjmp it
+   never touches the signal mask, so a switch costs no system call. */
+extern "C" void uthreads_switch_context(void **save_sp, void *load_sp);
+
+asm(R"(
+    .text
+    .p2align 4
+    .globl uthreads_switch_context
+    .type uthreads_switch_context, @function
+uthreads_switch_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size uthreads_switch_context, .-uthreads_switch_context
+)");
+
+/* Frame that uthreads_switch_context pops when it resumes a thread for the first time. */
+struct InitialFrame {
+  uint32_t mxcsr;
+  uint16_t fpu_cw;
+  uint16_t padding;
+  uint64_t r15, r14, r13, r12, rbx, rbp;
+  void (*ret)();
+  uint64_t alignment; // keeps rsp 8 mod 16 on entry, as after a call
+};
+
+void thread_trampoline();
+
+/* Builds the frame that makes uthreads_switch_context start entry on the given stack. Returns the context. */
+void *make_initial_frame(char *stack, size_t stack_size, void (*entry)()) {
+  address_t top = ((address_t) stack + stack_size) & ~(address_t) 15;
+  auto *frame = (InitialFrame *) (top - sizeof(InitialFrame));
+  *frame = InitialFrame();
+  frame->mxcsr = INITIAL_MXCSR;
+  frame->fpu_cw = INITIAL_FPU_CW;
+  frame->ret = entry;
+  return frame;
+}
+
+/* Whether tid is a live thread. An exited joinable thread only exists for uthread_join, and a dying task until its
+   frame is destroyed. */
+bool is_valid_tid(int tid) {
+  return tid >= 0 and tid < threads.capacity() and threads[tid].has_flag(FLAG_USED)
+         and !threads[tid].has_flag(FLAG_EXITED | FLAG_DYING);
+}
+
+/* Returns the lowest free tid and marks it as used, growing the thread table if needed, or NO_TID if the table is
+   full. */
+int allocate_tid() {
+  while (first_free_word < TID_WORDS and used_tids[first_free_word] == ~0ULL) {
+      first_free_word++;
+    }
+  if (first_free_word == TID_WORDS) {
+      return NO_TID;
+    }
+  int tid = first_free_word * TID_WORD_BITS + __builtin_ctzll(~used_tids[first_free_word]);
+  if (tid >= MAX_THREAD_NUM) {
+      return NO_TID;
+    }
+  if (tid >= threads.capacity()) {
+      threads.grow();
+    }
+  used_tids[first_free_word] |= 1ULL << (tid % TID_WORD_BITS);
+  num_threads++;
+  return tid;
+}
+
+/* Maps a stack of at least stack_size bytes with a PROT_NONE guard page below it. The mapping is not reserved, so
+   physical memory is only committed for the pages the thread actually touches. Returns the lowest usable address,
+   and sets guarded to whether the guard page is protected. */
+char *map_stack(size_t stack_size, bool &guarded) {
+  size_t mapping_size = stack_size + page_size;
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (mapping == MAP_FAILED) {
+      std::cerr << "system error: stack allocation fails" << std::endl;
+      exit(1);
+    }
+  // The kernel limits the number of mappings (vm.max_map_count) and every guard page splits one, so past
+  // max_guarded_stacks the guard is left writable. Such stacks merge with their neighbours into a single mapping and
+  // rely on the canary check alone.
+  guarded = mapped_stacks < max_guarded_stacks;
+  if (guarded and mprotect(mapping, page_size, PROT_NONE)) {
+      std::cerr << "system error: stack guard page fails" << std::endl;
+      exit(1);
+    }
+  mapped_stacks++;
+  mapped_stack_bytes += mapping_size;
+  return (char *) mapping + page_size;
+}
+
+void unmap_stack(char *stack, size_t stack_size) {
+  if (munmap(stack - page_size, stack_size + page_size)) {
+      std::cerr << "system error: stack release fails" << std::endl;
+      exit(1);
+    }
+  mapped_stacks--;
+  mapped_stack_bytes -= stack_size + page_size;
+}
+
+/* Leaves half of the process mappings to the application. */
+long read_max_guarded_stacks() {
+  long max_map_count = DEFAULT_MAX_MAP_COUNT;
+  FILE *file = fopen("/proc/sys/vm/max_map_count", "r");
+  if (file != nullptr) {
+      if (fscanf(file, "%ld", &max_map_count) != 1) {
+          max_map_count = DEFAULT_MAX_MAP_COUNT;
+        }
+      fclose(file);
+    }
+  return max_map_count / 4;
+}
+
+/* Catches overflows of the stacks that have no guard page. Checked whenever a thread is switched out. A guarded stack
+   carries no canary, so that its lowest page is only committed if the thread actually reaches it. */
+void check_stack_canary(int tid) {
+  if (threads[tid].has_flag(FLAG_UNGUARDED) and *(uint64_t *) threads[tid].get_stack() != STACK_CANARY) {
+      std::cerr << "system error: stack overflow in thread " << tid << std::endl;
+      exit(1);
+    }
+}
+
+char *allocate_stack(size_t stack_size, bool &guarded) {
+  char *stack = stack_pool.take(stack_size, guarded);
+  return stack != nullptr ? stack : map_stack(stack_size, guarded);
+}
+
+void free_stack(char *stack, size_t stack_size, bool guarded) {
+  if (!stack_pool.give(stack, stack_size, guarded)) {
+      unmap_stack(stack, stack_size);
+    }
+}
+
+/* Releases the stack of a thread that terminated itself. Called right after every switch. */
+void reap_dead_stack() {
+  if (dead_stack != nullptr) {
+      free_stack(dead_stack, dead_stack_size, dead_stack_guarded);
+      dead_stack = nullptr;
+    }
+}
+
+// --- arenas ---
+
+Arena library_arena; // records of the library, allocated and freed in the critical section, never with malloc
+ArenaChunk *cached_chunks = nullptr;
+int num_cached_chunks = 0;
+size_t mapped_arena_bytes = 0;
+
+/* Maps a chunk of size bytes, a multiple of the page size, aligned to ARENA_CHUNK_SIZE. Called in the critical
+   section. */
+ArenaChunk *map_chunk(size_t size) {
+  if (size == ARENA_CHUNK_SIZE and cached_chunks != nullptr) {
+      ArenaChunk *chunk = cached_chunks;
+      cached_chunks = chunk->next;
+      num_cached_chunks--;
+      return chunk;
+    }
+  size_t mapping_size = size + ARENA_CHUNK_SIZE;
+  void *mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+      std::cerr << "system error: arena allocation fails" << std::endl;
+      exit(1);
+    }
+  address_t start = ((address_t) mapping + ARENA_CHUNK_SIZE - 1) & ~(address_t) (ARENA_CHUNK_SIZE - 1);
+  size_t head = start - (address_t) mapping;
+  if ((head > 0 and munmap(mapping, head)) or munmap((char *) start + size, ARENA_CHUNK_SIZE - head)) {
+      std::cerr << "system error: arena allocation fails" << std::endl;
+      exit(1);
+    }
+  mapped_arena_bytes += size;
+  auto *chunk = (ArenaChunk *) start;
+  chunk->size = size;
+  return chunk;
+}
+
+/* Called in the critical section. */
+void unmap_chunk(ArenaChunk *chunk) {
+  if (chunk->size == ARENA_CHUNK_SIZE and num_cached_chunks < ARENA_CHUNK_CACHE) {
+      chunk->next = cached_chunks;
+      cached_chunks = chunk;
+      num_cached_chunks++;
+      return;
+    }
+  mapped_arena_bytes -= chunk->size;
+  if (munmap(chunk, chunk->size)) {
+      std::cerr << "system error: arena release fails" << std::endl;
+      exit(1);
+    }
+}
+
+ArenaChunk *chunk_of(void *block) {
+  return (ArenaChunk *) ((address_t) block & ~(address_t) (ARENA_CHUNK_SIZE - 1));
+}
+
+/* ARENA_LARGE for blocks larger than all the size classes. */
+int size_class_of(size_t size) {
+  if (size <= ARENA_MIN_BLOCK) {
+      return 0;
+    }
+  int size_class = 64 - __builtin_clzll(size - 1) - __builtin_ctz(ARENA_MIN_BLOCK);
+  return size_class < ARENA_CLASSES ? size_class : ARENA_LARGE;
+}
+
+/* Takes a block of size_class from arena without mapping anything. Returns nullptr if the class has no room left. */
+void *arena_take(Arena &arena, int size_class) {
+  void *block = arena.free_lists[size_class];
+  if (block != nullptr) {
+      arena.free_lists[size_class] = *(void **) block;
+      return block;
+    }
+  size_t block_size = (size_t) ARENA_MIN_BLOCK << size_class;
+  if ((size_t) (arena.end[size_class] - arena.bump[size_class]) < block_size) {
+      return nullptr;
+    }
+  block = arena.bump[size_class];
+  arena.bump[size_class] += block_size;
+  return block;
+}
+
+/* Allocates a block of size bytes from arena, which belongs to owner, mapping a chunk for it. Called in the critical
+   section, when arena_take found no room. */
+void *arena_grow(Arena &arena, int owner, size_t size) {
+  int size_class = size_class_of(size);
+  size_t chunk_size = ARENA_CHUNK_SIZE;
+  if (size_class == ARENA_LARGE) {
+      chunk_size = (sizeof(ArenaChunk) + size + page_size - 1) & ~(page_size - 1);
+    }
+  ArenaChunk *chunk = map_chunk(chunk_size);
+  chunk->size_class = size_class;
+  chunk->owner = owner;
+  chunk->prev = nullptr;
+  chunk->next = arena.chunks;
+  if (arena.chunks != nullptr) {
+      arena.chunks->prev = chunk;
+    }
+  arena.chunks = chunk;
+  if (size_class == ARENA_LARGE) {
+      return chunk + 1;
+    }
+  arena.bump[size_class] = (char *) (chunk + 1);
+  arena.end[size_class] = (char *) chunk + ARENA_CHUNK_SIZE;
+  return arena_take(arena, size_class);
+}
+
+/* Returns a block of size class to arena. */
+void arena_give(Arena &arena, void *block, int size_class) {
+  *(void **) block = arena.free_lists[size_class];
+  arena.free_lists[size_class] = block;
+}
+
+/* Unmaps the chunk of a large block of arena. Called in the critical section. */
+void arena_give_large(Arena &arena, ArenaChunk *chunk) {
+  if (chunk->prev != nullptr) {
+      chunk->prev->next = chunk->next;
+    } else {
+      arena.chunks = chunk->next;
+    }
+  if (chunk->next != nullptr) {
+      chunk->next->prev = chunk->prev;
+    }
+  unmap_chunk(chunk);
+}
+
+/* Releases all the blocks of arena at once. Called in the critical section. */
+void release_arena(Arena &arena) {
+  while (arena.chunks != nullptr) {
+      ArenaChunk *chunk = arena.chunks;
+      arena.chunks = chunk->next;
+      unmap_chunk(chunk);
+    }
+}
+
+/* Constructs a record of the library in the library arena, so that the critical section never calls into malloc,
+   whose lock a preempted thread may hold. Called in the critical section. */
+template <typename T, typename... Args>
+T *pool_new(Args &&...args) {
+  int size_class = size_class_of(sizeof(T));
+  void *block = arena_take(library_arena, size_class);
+  if (block == nullptr) {
+      block = arena_grow(library_arena, NO_TID, sizeof(T));
+    }
+  return new (block) T(std::forward<Args>(args)...);
+}
+
+/* Destroys a record made by pool_new. Called in the critical section. */
+template <typename T>
+void pool_delete(T *record) {
+  if (record == nullptr) {
+      return;
+    }
+  record->~T();
+  arena_give(library_arena, record, size_class_of(sizeof(T)));
+}
+
+/* Allocates size bytes for an array of the library in the library arena, as pool_new does for a record. Large arrays
+   get a chunk of their own. Called in the critical section. */
+void *pool_alloc(size_t size) {
+  int size_class = size_class_of(size);
+  void *block = size_class != ARENA_LARGE ? arena_take(library_arena, size_class) : nullptr;
+  return block != nullptr ? block : arena_grow(library_arena, NO_TID, size);
+}
+
+/* Frees an array made by pool_alloc. Called in the critical section. */
+void pool_free(void *block) {
+  if (block == nullptr) {
+      return;
+    }
+  ArenaChunk *chunk = chunk_of(block);
+  if (chunk->size_class == ARENA_LARGE) {
+      arena_give_large(library_arena, chunk);
+    } else {
+      arena_give(library_arena, block, chunk->size_class);
+    }
+}
+
+void leave_group(int tid);
+
+/* The local data of tid, created if it has none. Called in the critical section. */
+LocalData *local_data_of(int tid) {
+  if (threads[tid].get_local() == nullptr) {
+      threads[tid].set_local(pool_new<LocalData>());
+    }
+  return threads[tid].get_local();
+}
+
+void release_local_data(int tid) {
+  LocalData *local = threads[tid].get_local();
+  if (local != nullptr) {
+      release_arena(local->arena);
+      pool_delete(local);
+    }
+}
+
+
+void release_tid(int tid) {
+  JoinState *join = threads[tid].get_join();
+  if (join != nullptr) {
+      pool_delete(join->joiners);
+      pool_delete(join);
+      threads[tid].set_join(nullptr);
+    }
+  release_local_data(tid);
+  count_runnable(tid, threads[tid].get_state() != BLOCKED, false);
+  leave_group(tid);
+  threads[tid].clear_flag(FLAG_USED | FLAG_BLOCKED | FLAG_SLEEPING | FLAG_TIMED_SLEEP | FLAG_THROTTLED
+                          | FLAG_JOINABLE | FLAG_EXITED | FLAG_LOCAL_DATA | FLAG_DYING | FLAG_UNGUARDED);
+  sched_stats.by_state[threads[tid].get_state()]--;
+  used_tids[tid / TID_WORD_BITS] &= ~(1ULL << (tid % TID_WORD_BITS));
+  if (tid / TID_WORD_BITS < first_free_word) {
+      first_free_word = tid / TID_WORD_BITS;
+    }
+  num_threads--;
+}
+
+
+uint64_t now_nsecs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* Starts the statistics of a new thread, which is READY. */
+void reset_stats(int tid) {
+  memset(&threads.stats(tid), 0, sizeof(ThreadStats));
+  threads.stats(tid).since = now_nsecs();
+  sched_stats.by_state[READY]++;
+}
+
+/* Histogram bucket of a latency: 0 below a micro-second, then one bucket per power of two micro-seconds. */
+int latency_bucket(uint64_t nsecs) {
+  uint64_t usecs = nsecs / NSECS_PER_USEC;
+  int bucket = usecs == 0 ? 0 : 64 - __builtin_clzll(usecs);
+  return bucket < UTHREAD_LATENCY_BUCKETS ? bucket : UTHREAD_LATENCY_BUCKETS - 1;
+}
+
+/* Charges tid for the time it spent in the state it leaves: time spent READY before running is its scheduling
+   latency, and time spent BLOCKED counts as blocked, unless awake_thread already charged it as sleep. */
+void record_state_change(int tid, int old_state, int new_state) {
+  if (old_state == new_state) {
+      return;
+    }
+  ThreadStats &stats = threads.stats(tid);
+  uint64_t now = now_nsecs();
+  uint64_t spent = now - stats.since;
+  if (old_state == BLOCKED) {
+      stats.block_nsecs += spent;
+    } else if (old_state == READY and new_state == RUNNING) {
+      stats.ready_wait_nsecs += spent;
+      stats.max_latency_nsecs = spent > stats.max_latency_nsecs ? spent : stats.max_latency_nsecs;
+      stats.latency_histogram[latency_bucket(spent)]++;
+      sched_stats.ready_wait_nsecs += spent;
+      sched_stats.max_latency_nsecs = spent > sched_stats.max_latency_nsecs ? spent : sched_stats.max_latency_nsecs;
+      sched_stats.latency_histogram[latency_bucket(spent)]++;
+    }
+  sched_stats.by_state[old_state]--;
+  sched_stats.by_state[new_state]++;
+  stats.since = now;
+}
+
+/* Charges a sleeper that wakes up for the time it slept. */
+void record_sleep_end(int tid) {
+  ThreadStats &stats = threads.stats(tid);
+  uint64_t now = now_nsecs();
+  stats.sleep_nsecs += now - stats.since;
+  stats.since = now;
+}
+
+/* Counts a switch away from tid: voluntary if the thread gave up the CPU, involuntary if it was preempted. */
+void record_switch(int tid, bool voluntary) {
+  if (voluntary) {
+      threads.stats(tid).voluntary_switches++;
+      sched_stats.voluntary_switches++;
+    } else {
+      threads.stats(tid).involuntary_switches++;
+      sched_stats.involuntary_switches++;
+    }
+}
+
+ThreadHeap &sleep_heap_of(int tid) {
+  return threads[tid].has_flag(FLAG_TIMED_SLEEP) ? timed_sleepers : quantum_sleepers;
+}
+
+/* Moves a thread to the READY state, restarting the quantum timer if it was stopped. If it outranks the running
+   thread, the running thread is preempted as soon as the critical section is left. */
+void restart_stopped_timer();
+
+void make_ready(int tid) {
+  threads[tid].set_state(READY);
+  ready_q.push_back(tid);
+  restart_stopped_timer();
+  if (outranks(tid, running_thread)) {
+      reschedule_pending = 1;
+    }
+}
+
+void awake_thread(int tid) {
+  TRACE(TRACE_WAKE, tid);
+  sleep_heap_of(tid).remove(tid);
+  record_sleep_end(tid);
+  threads[tid].clear_flag(FLAG_SLEEPING | FLAG_TIMED_SLEEP | FLAG_THROTTLED);
+  if (!threads[tid].has_flag(FLAG_BLOCKED)) {
+      make_ready(tid);
+    }
+}
+
+
+// --- thread class implementation ---
+
+void Thread::init(int tid, thread_entry_point entryPoint, char *stack, size_t stack_size) {
+  this->tid = tid;
+  this->state = READY;
+  this->flags = FLAG_USED;
+  this->heap_index = -1;
+  this->wake_at = 0;
+  this->priority = UTHREAD_PRIO_DEFAULT;
+  this->base_priority = UTHREAD_PRIO_DEFAULT;
+  this->group = UTHREAD_GROUP_ROOT;
+  this->vruntime = 0;
+  this->run_start = 0;
+  this->runtime = 0;
+  this->next = NO_TID;
+  this->prev = NO_TID;
+  this->entryPoint = entryPoint;
+  this->dl = nullptr;
+  this->join = nullptr;
+  this->worker = worker_index;
+  this->running_on = worker_index;
+  this->wait_queue = nullptr;
+  this->quantums_counter = 0;
+  this->sp = nullptr;
+  this->stack = stack;
+  this->stack_size = stack_size;
+  reset_stats(tid);
+  if (entryPoint == nullptr) { // the main thread keeps its own stack and pc
+      return;
+    }
+  this->sp = make_initial_frame(stack, stack_size, &thread_trampoline);
+}
+
+/*getters and setters of Thread*/
+
+int Thread::get_thread_quantums() const {
+  return this->quantums_counter;
+}
+
+void Thread::increment_quantums() {
+  this->quantums_counter++;
+}
+
+int Thread::get_tid() const {
+  return this->tid;
+}
+
+int Thread::get_state() const {
+  return this->state;
+}
+
+void Thread::set_state(int new_state) {
+  record_state_change(this->tid, this->state, new_state);
+  count_runnable(this->tid, this->state != BLOCKED, new_state != BLOCKED);
+  this->state = new_state;
+}
+
+bool Thread::has_flag(int flag) const {
+  return (this->flags & flag) != 0;
+}
+
+void Thread::set_flag(int flag) {
+  this->flags |= flag;
+}
+
+void Thread::clear_flag(int flag) {
+  this->flags &= ~flag;
+}
+
+uint64_t Thread::get_wake_at() const {
+  return this->wake_at;
+}
+
+void Thread::set_wake_at(uint64_t wake_at) {
+  this->wake_at = wake_at;
+}
+
+int Thread::get_priority() const {
+  return this->priority;
+}
+
+void Thread::set_priority(int priority) {
+  this->priority = priority;
+}
+
+int Thread::get_base_priority() const {
+  return this->base_priority;
+}
+
+void Thread::set_base_priority(int base_priority) {
+  this->base_priority = base_priority;
+}
+
+int Thread::get_group() const {
+  return this->group;
+}
+
+void Thread::set_group(int group) {
+  this->group = group;
+}
+
+uint64_t Thread::get_vruntime() const {
+  return this->vruntime;
+}
+
+void Thread::set_vruntime(uint64_t vruntime) {
+  this->vruntime = vruntime;
+}
+
+uint64_t Thread::get_run_start() const {
+  return this->run_start;
+}
+
+void Thread::set_run_start(uint64_t run_start) {
+  this->run_start = run_start;
+}
+
+uint64_t Thread::get_runtime() const {
+  return this->runtime;
+}
+
+void Thread::add_runtime(uint64_t nsecs) {
+  this->runtime += nsecs;
+}
+
+char *Thread::get_stack() const {
+  return this->stack;
+}
+
+size_t Thread::get_stack_size() const {
+  return this->stack_size;
+}
+
+void *Thread::get_frame() const {
+  return this->frame;
+}
+
+void Thread::set_frame(void *frame) {
+  this->frame = frame;
+}
+
+thread_entry_point Thread::get_entry_point() const {
+  return this->entryPoint;
+}
+
+LocalData *Thread::get_local() const {
+  return has_flag(FLAG_LOCAL_DATA) ? this->local : nullptr;
+}
+
+void Thread::set_local(LocalData *local) {
+  this->local = local;
+  set_flag(FLAG_LOCAL_DATA);
+}
+
+DeadlineParams *Thread::get_deadline() const {
+  return this->dl;
+}
+
+JoinState *Thread::get_join() const {
+  return this->join;
+}
+
+void Thread::set_join(JoinState *join) {
+  this->join = join;
+}
+
+void Thread::set_deadline(DeadlineParams *dl) {
+  this->dl = dl;
+}
+
+uint32_t Thread::get_queue_seq() const {
+  return this->queue_seq;
+}
+
+void Thread::bump_queue_seq() {
+  this->queue_seq++;
+}
+
+int Thread::get_worker() const {
+  return this->worker;
+}
+
+void Thread::set_worker(int worker) {
+  this->worker = worker;
+}
+
+int Thread::get_running_on() const {
+  return this->running_on;
+}
+
+void Thread::set_running_on(int running_on) {
+  this->running_on = running_on;
+}
+
+ThreadQueue *Thread::get_wait_queue() const {
+  return this->wait_queue;
+}
+
+void Thread::set_wait_queue(ThreadQueue *wait_queue) {
+  this->wait_queue = wait_queue;
+}
+
+ChanSelect *Thread::get_select() const {
+  return this->select;
+}
+
+void Thread::set_select(ChanSelect *select) {
+  this->select = select;
+}
+
+void **Thread::get_context() {
+  return &this->sp;
+}
+
+
+// --- thread queue implementation ---
+
+void ThreadQueue::push_back(int tid) {
+  threads[tid].next = NO_TID;
+  threads[tid].prev = tail;
+  if (tail == NO_TID) {
+      head = tid;
+    } else {
+      threads[tail].next = tid;
+    }
+  tail = tid;
+}
+
+void ThreadQueue::push_front(int tid) {
+  threads[tid].prev = NO_TID;
+  threads[tid].next = head;
+  if (head == NO_TID) {
+      tail = tid;
+    } else {
+      threads[head].prev = tid;
+    }
+  head = tid;
+}
+
+int ThreadQueue::pop_front() {
+  int tid = head;
+  remove(tid);
+  return tid;
+}
+
+void ThreadQueue::remove(int tid) {
+  int next = threads[tid].next;
+  int prev = threads[tid].prev;
+  if (prev == NO_TID) {
+      head = next;
+    } else {
+      threads[prev].next = next;
+    }
+  if (next == NO_TID) {
+      tail = prev;
+    } else {
+      threads[next].prev = prev;
+    }
+  threads[tid].next = NO_TID;
+  threads[tid].prev = NO_TID;
+}
+
+
+// --- ready queue implementation ---
+
+uint64_t deque_entry(int tid) {
+  return (uint64_t) threads[tid].get_queue_seq() << 32 | (uint32_t) tid;
+}
+
+/* The thread of an entry this worker took from a deque, or NO_TID if the entry is stale. A pinned thread of another
+   worker is pushed back to its own deque. */
+int ReadyQueue::claim(uint64_t entry) {
+  int tid = (int) (uint32_t) entry;
+  Thread &thread = threads[tid];
+  if (thread.get_queue_seq() != (uint32_t) (entry >> 32) or thread.get_state() != READY) {
+      return NO_TID; // removed from the ready queue, or pushed again since
+    }
+  if (thread.has_flag(FLAG_PINNED) and thread.get_worker() != worker_index) {
+      push_back(tid);
+      return NO_TID;
+    }
+  thread.set_worker(worker_index);
+  thread.bump_queue_seq();
+  return tid;
+}
+
+/* Takes the oldest live entry of the deque of victim. */
+int ReadyQueue::take_from(int victim) {
+  WorkDeque &deque = workers[victim].deque;
+  uint64_t entry;
+  for (int64_t attempts = deque.size(); attempts > 0 and deque.steal(entry); attempts--) {
+      int tid = claim(entry);
+      if (tid != NO_TID) {
+          return tid;
+        }
+    }
+  return NO_TID;
+}
+
+/* Own threads first, in FIFO order, then threads stolen from the other workers. Returns NO_TID if there is none. */
+int ReadyQueue::pop_distributed() {
+  for (int i = 0; i < num_workers; i++) {
+      int tid = take_from((worker_index + i) % num_workers);
+      if (tid != NO_TID) {
+          return tid;
+        }
+    }
+  return NO_TID;
+}
+
+/* With several workers, whether this worker's deque looks empty. */
+bool ReadyQueue::empty() const {
+  if (distributed) {
+      return workers[worker_index].deque.empty();
+    }
+  return non_empty == 0 and by_vruntime.empty() and by_deadline.empty();
+}
+
+/* With several workers, the length of this worker's deque, which may still hold entries of threads that left it. */
+int ReadyQueue::size() const {
+  if (distributed) {
+      return (int) workers[worker_index].deque.size();
+    }
+  return count;
+}
+
+/* With several workers there is no global order, and NO_TID is returned. */
+int ReadyQueue::front() const {
+  if (distributed) {
+      return NO_TID;
+    }
+  if (!by_deadline.empty()) {
+      return by_deadline.top();
+    }
+  if (fair) {
+      return by_vruntime.top();
+    }
+  return levels[top_priority()].front();
+}
+
+void ReadyQueue::push_back(int tid) {
+  if (distributed) {
+      threads[tid].bump_queue_seq();
+      workers[threads[tid].get_worker()].deque.push(deque_entry(tid));
+      return;
+    }
+  count++;
+  if (threads[tid].get_deadline() != nullptr) {
+      by_deadline.push(tid);
+      return;
+    }
+  if (fair) {
+      by_vruntime.push(tid);
+      return;
+    }
+  int priority = threads[tid].get_priority();
+  levels[priority].push_back(tid);
+  non_empty |= 1U << priority;
+}
+
+void ReadyQueue::push_front(int tid) {
+  if (distributed) {
+      push_back(tid);
+      return;
+    }
+  count++;
+  if (threads[tid].get_deadline() != nullptr) {
+      by_deadline.push(tid);
+      return;
+    }
+  if (fair) {
+      by_vruntime.push(tid);
+      return;
+    }
+  int priority = threads[tid].get_priority();
+  levels[priority].push_front(tid);
+  non_empty |= 1U << priority;
+}
+
+/* Removes and returns the deadline thread with the earliest deadline, or else the next thread of the policy. Returns
+   NO_TID if no thread is READY. */
+int ReadyQueue::pop_front() {
+  if (distributed) {
+      return pop_distributed();
+    }
+  if (empty()) {
+      return NO_TID;
+    }
+  count--;
+  if (!by_deadline.empty()) {
+      int tid = by_deadline.top();
+      by_deadline.remove(tid);
+      return tid;
+    }
+  if (fair) {
+      int tid = by_vruntime.top();
+      by_vruntime.remove(tid);
+      return tid;
+    }
+  int priority = top_priority();
+  int tid = levels[priority].pop_front();
+  if (levels[priority].empty()) {
+      non_empty &= ~(1U << priority);
+    }
+  return tid;
+}
+
+/* With several workers the deque entry is left in place and skipped once it is taken. */
+void ReadyQueue::remove(int tid) {
+  if (distributed) {
+      threads[tid].bump_queue_seq();
+      return;
+    }
+  count--;
+  if (threads[tid].get_deadline() != nullptr) {
+      by_deadline.remove(tid);
+      return;
+    }
+  if (fair) {
+      by_vruntime.remove(tid);
+      return;
+    }
+  int priority = threads[tid].get_priority();
+  levels[priority].remove(tid);
+  if (levels[priority].empty()) {
+      non_empty &= ~(1U << priority);
+    }
+}
+
+/* Takes the oldest entry of the deque of any worker, this worker's first, without the scheduler lock. The entry is
+   only checked once the lock is held, by adopt. */
+bool ReadyQueue::steal_unlocked(uint64_t &entry) {
+  for (int i = 0; i < num_workers; i++) {
+      if (workers[(worker_index + i) % num_workers].deque.steal_unlocked(entry)) {
+          return true;
+        }
+    }
+  return false;
+}
+
+/* Moves the thread of an entry taken by steal_unlocked to the deque of this worker, unless the entry went stale
+   meanwhile. */
+void ReadyQueue::adopt(uint64_t entry) {
+  int tid = claim(entry);
+  if (tid != NO_TID) {
+      push_back(tid);
+    }
+}
+
+/* Lifts every READY thread that the MLFQ feedback demoted back to its base priority, so CPU-bound threads are not
+   starved forever. */
+void ReadyQueue::boost() {
+  for (int priority = 0; priority < UTHREAD_PRIO_LEVELS; priority++) {
+      ThreadQueue staying;
+      while (!levels[priority].empty()) {
+          int tid = levels[priority].pop_front();
+          if (threads[tid].get_base_priority() != priority) {
+              threads[tid].set_priority(threads[tid].get_base_priority());
+              count--; // push_back counts it again
+              push_back(tid);
+            } else {
+              staying.push_back(tid);
+            }
+        }
+      while (!staying.empty()) {
+          levels[priority].push_back(staying.pop_front());
+        }
+      if (levels[priority].empty()) {
+          non_empty &= ~(1U << priority);
+        }
+    }
+}
+
+
+// --- work deque implementation ---
+
+WorkDeque::Array *WorkDeque::new_array(int64_t capacity) {
+  size_t mapped = (sizeof(Array) + capacity * sizeof(std::atomic<uint64_t>) + page_size - 1) & ~(page_size - 1);
+  void *mapping = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+      std::cerr << "system error: work deque allocation fails" << std::endl;
+      exit(1);
+    }
+  auto *array = (Array *) mapping;
+  array->capacity = capacity;
+  array->mapped = mapped;
+  array->replaced = nullptr;
+  array->slots = (std::atomic<uint64_t> *) (array + 1);
+  return array;
+}
+
+/* Copies the live entries to an array twice as large and retires the old one. */
+WorkDeque::Array *WorkDeque::grow(Array *old, int64_t top_index, int64_t bottom_index) {
+  Array *bigger = new_array(old->capacity * 2);
+  for (int64_t i = top_index; i < bottom_index; i++) {
+      bigger->slots[i & (bigger->capacity - 1)].store(old->slots[i & (old->capacity - 1)].load(std::memory_order_relaxed),
+                                                      std::memory_order_relaxed);
+    }
+  array.store(bigger, std::memory_order_seq_cst);
+  old->replaced = retired;
+  retired = old;
+  return bigger;
+}
+
+/* Unmaps the retired arrays once no taker without the lock is in steal_unlocked. One that enters afterwards loads
+   the current array, which was stored before unlocked_takers was read. */
+void WorkDeque::release_retired() {
+  if (unlocked_takers.load(std::memory_order_seq_cst) != 0) {
+      return;
+    }
+  while (retired != nullptr) {
+      Array *next = retired->replaced;
+      if (munmap(retired, retired->mapped)) {
+          std::cerr << "system error: work deque release fails" << std::endl;
+          exit(1);
+        }
+      retired = next;
+    }
+}
+
+void WorkDeque::push(uint64_t entry) {
+  int64_t bottom_index = bottom.load(std::memory_order_relaxed);
+  int64_t top_index = top.load(std::memory_order_acquire);
+  Array *current = array.load(std::memory_order_relaxed);
+  if (current == nullptr) {
+      current = new_array(DEQUE_INITIAL_CAPACITY);
+      array.store(current, std::memory_order_release);
+    } else if (bottom_index - top_index >= current->capacity) {
+      current = grow(current, top_index, bottom_index);
+    }
+  current->slots[bottom_index & (current->capacity - 1)].store(entry, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom.store(bottom_index + 1, std::memory_order_relaxed);
+  if (retired != nullptr) {
+      release_retired();
+    }
+}
+
+/* Takes the entry at the top. Retries when it loses a race with another taker, so it only fails on an empty deque. */
+bool WorkDeque::steal(uint64_t &entry) {
+  for (;;) {
+      int64_t top_index = top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t bottom_index = bottom.load(std::memory_order_acquire);
+      if (top_index >= bottom_index) {
+          return false;
+        }
+      Array *current = array.load(std::memory_order_acquire);
+      entry = current->slots[top_index & (current->capacity - 1)].load(std::memory_order_relaxed);
+      if (top.compare_exchange_strong(top_index, top_index + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+          return true;
+        }
+    }
+}
+
+/* Takes the entry at the top without the scheduler lock, so concurrently with a push that may retire the array it
+   reads. The taker is counted meanwhile, which keeps the retired arrays mapped. */
+bool WorkDeque::steal_unlocked(uint64_t &entry) {
+  unlocked_takers.fetch_add(1, std::memory_order_seq_cst);
+  bool taken = steal(entry);
+  unlocked_takers.fetch_sub(1, std::memory_order_release);
+  return taken;
+}
+
+
+// --- thread table implementation ---
+
+/* Maps size bytes of zeroed memory, aligned to pages. The table grows in the critical section, so it is mapped
+   rather than taken from malloc. */
+void *map_table_chunk(size_t size) {
+  void *chunk = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chunk == MAP_FAILED) {
+      std::cerr << "system error: Memory allocation fails" << std::endl;
+      exit(1);
+    }
+  return chunk;
+}
+
+void ThreadTable::grow() {
+  stats_chunks[num_chunks] = (ThreadStats *) map_table_chunk(TABLE_CHUNK * sizeof(ThreadStats));
+  chunks[num_chunks++] = (Thread *) map_table_chunk(TABLE_CHUNK * sizeof(Thread));
+}
+
+
+// --- thread heap implementation ---
+
+uint64_t ThreadHeap::key(int tid) const {
+  if (key_kind == HEAP_BY_DEADLINE) {
+      return threads[tid].dl->abs_deadline;
+    }
+  return key_kind == HEAP_BY_VRUNTIME ? threads[tid].vruntime : threads[tid].wake_at;
+}
+
+void ThreadHeap::place(int index, int tid) {
+  heap[index] = tid;
+  threads[tid].heap_index = index;
+}
+
+void ThreadHeap::sift_up(int index) {
+  int tid = heap[index];
+  while (index > 0) {
+      int parent = (index - 1) / 2;
+      if (key(heap[parent]) <= key(tid)) {
+          break;
+        }
+      place(index, heap[parent]);
+      index = parent;
+    }
+  place(index, tid);
+}
+
+void ThreadHeap::sift_down(int index) {
+  int tid = heap[index];
+  int size = (int) heap.size();
+  while (2 * index + 1 < size) {
+      int child = 2 * index + 1;
+      if (child + 1 < size and key(heap[child + 1]) < key(heap[child])) {
+          child++;
+        }
+      if (key(tid) <= key(heap[child])) {
+          break;
+        }
+      place(index, heap[child]);
+      index = child;
+    }
+  place(index, tid);
+}
+
+void ThreadHeap::push(int tid) {
+  heap.push_back(tid);
+  sift_up(heap.size() - 1);
+}
+
+void ThreadHeap::remove(int tid) {
+  int index = threads[tid].heap_index;
+  int last = heap.back();
+  heap.pop_back();
+  threads[tid].heap_index = -1;
+  if (index == (int) heap.size()) {
+      return;
+    }
+  place(index, last);
+  sift_up(index);
+  sift_down(threads[last].heap_index);
+}
+
+
+
+
+// --- stack pool implementation ---
+
+char *&StackPool::next_of(char *stack, size_t stack_size) {
+  return *(char **) (stack + stack_size - sizeof(char *));
+}
+
+bool &StackPool::guarded_of(char *stack, size_t stack_size) {
+  return *(bool *) (stack + stack_size - 2 * sizeof(char *));
+}
+
+/* Returns a cached stack of exactly stack_size bytes, or nullptr if there is none. */
+char *StackPool::take(size_t stack_size, bool &guarded) {
+  for (Bucket &bucket : buckets) {
+      if (bucket.stack_size == stack_size and bucket.head != nullptr) {
+          char *stack = bucket.head;
+          bucket.head = next_of(stack, stack_size);
+          guarded = guarded_of(stack, stack_size);
+          cached--;
+          return stack;
+        }
+    }
+  return nullptr;
+}
+
+/* Caches a released stack. Returns false if the pool is at its high-water mark or has no bucket for this size, in
+   which case the caller unmaps the stack. */
+bool StackPool::give(char *stack, size_t stack_size, bool guarded) {
+  if (limit != NO_LIMIT and cached >= limit) {
+      return false;
+    }
+  Bucket *free_bucket = nullptr;
+  for (Bucket &bucket : buckets) {
+      if (bucket.stack_size == stack_size) {
+          free_bucket = &bucket;
+          break;
+        }
+      if (bucket.head == nullptr and free_bucket == nullptr) {
+          free_bucket = &bucket;
+        }
+    }
+  if (free_bucket == nullptr) {
+      return false;
+    }
+  free_bucket->stack_size = stack_size;
+  next_of(stack, stack_size) = free_bucket->head;
+  guarded_of(stack, stack_size) = guarded;
+  free_bucket->head = stack;
+  cached++;
+  return true;
+}
+
+/* Unmaps cached stacks until at most keep are left. Returns the number of stacks released. */
+int StackPool::trim(int keep) {
+  int released = 0;
+  for (Bucket &bucket : buckets) {
+      while (cached > keep and bucket.head != nullptr) {
+          char *stack = bucket.head;
+          bucket.head = next_of(stack, bucket.stack_size);
+          unmap_stack(stack, bucket.stack_size);
+          cached--;
+          released++;
+        }
+    }
+  return released;
+}
+
+
+
+
+// --- scheduler implementation ---
+
+extern int io_parked;
+
+/* Weights of the priority levels under the fair policy. Each level gets 1.25 times the CPU share of the one below. */
+const uint64_t fair_weights[UTHREAD_PRIO_LEVELS] = {419, 524, 655, 819, FAIR_NICE_0_WEIGHT, 1280, 1600, 2000};
+
+void join_group(int tid, int group);
+
+class Scheduler {
+ private:
+  int quantum_usecs;
+  int policy;
+  uint64_t min_vruntime = 0; // never decreases, new and waking threads are placed relative to it
+  uint64_t deadline_bandwidth = 0; // reserved by all deadline threads together
+  struct sigaction sa = {0};
+  int timer_source = UTHREAD_TIMER_VIRTUAL;
+  uint64_t target_latency = 0; // adaptive quantum: time in which every runnable thread should run once, 0 if fixed
+  uint64_t min_granularity = 0; // adaptive quantum: shortest quantum
+  int interactivity = 0; // moving average of the share of switches where the thread gave up the CPU early
+
+ public:
+  Scheduler() {}
+
+  Scheduler(int quantum_usecs, int policy) {
+    this->quantum_usecs = quantum_usecs;
+    this->policy = policy;
+  }
+
+  int get_policy() const { return this->policy; }
+
+  uint64_t get_quantum_nsecs() const { return quantum_usecs * NSECS_PER_USEC; }
+
+  void set_adaptive(uint64_t latency, uint64_t granularity) {
+    target_latency = latency;
+    min_granularity = granularity;
+  }
+
+  /* Length of the next quantum. Adaptive quantums share the target latency among the runnable threads of this
+     worker, so a few CPU-bound threads run long quantums, and are cut by up to half as the load turns interactive.
+     Sleepers and I/O are only checked at switches, so threads waiting for I/O count as runnable and a quantum ends
+     when the first timed sleeper is due. Quantums never go below the minimum granularity. */
+  uint64_t slice_nsecs() const {
+    if (target_latency == 0) {
+        return get_quantum_nsecs();
+      }
+    uint64_t slice = target_latency / (ready_q.size() + io_parked + 1);
+    slice -= slice * interactivity / (2 * INTERACTIVITY_SCALE);
+    if (!timed_sleepers.empty()) {
+        uint64_t wake_at = threads[timed_sleepers.top()].get_wake_at();
+        uint64_t now = now_nsecs();
+        slice = wake_at <= now ? 0 : wake_at - now < slice ? wake_at - now : slice;
+      }
+    return slice > min_granularity ? slice : min_granularity;
+  }
+
+  /* How far behind the running thread a waking thread must be to preempt it under the fair policy. */
+  uint64_t wakeup_granularity() const {
+    return target_latency != 0 ? min_granularity : get_quantum_nsecs() / 2;
+  }
+
+  /* MLFQ feedback: a thread that used its whole quantum is CPU-bound and drops one level. */
+  void on_quantum_expired(int tid) {
+    interactivity -= interactivity >> INTERACTIVITY_SHIFT;
+    if (policy == UTHREAD_SCHED_MLFQ and threads[tid].get_priority() > 0) {
+        threads[tid].set_priority(threads[tid].get_priority() - 1);
+      }
+  }
+
+  /* MLFQ feedback: a thread that gave up the CPU before its quantum ended is interactive and climbs back one level,
+     up to its base priority. */
+  void on_voluntary_switch(int tid) {
+    interactivity += (INTERACTIVITY_SCALE - interactivity) >> INTERACTIVITY_SHIFT;
+    if (policy == UTHREAD_SCHED_MLFQ and threads[tid].get_priority() < threads[tid].get_base_priority()) {
+        threads[tid].set_priority(threads[tid].get_priority() + 1);
+      }
+  }
+
+  /* Virtual runtime of tid, including the part of its current run not yet charged. */
+  uint64_t current_vruntime(int tid) const {
+    uint64_t vruntime = threads[tid].get_vruntime();
+    if (tid == running_thread) {
+        vruntime += (now_nsecs() - threads[tid].get_run_start()) * FAIR_NICE_0_WEIGHT
+                    / fair_weights[threads[tid].get_priority()];
+      }
+    return vruntime;
+  }
+
+  /* Charges the running thread for the time it ran: its runtime, its virtual runtime weighted by its priority, and
+     the budget of a deadline thread. */
+  void charge_runtime(int tid) {
+    uint64_t now = now_nsecs();
+    uint64_t ran = now - threads[tid].get_run_start();
+    threads[tid].add_runtime(ran);
+    if (policy == UTHREAD_SCHED_FAIR) {
+        threads[tid].set_vruntime(threads[tid].get_vruntime()
+                                  + ran * FAIR_NICE_0_WEIGHT / fair_weights[threads[tid].get_priority()]);
+      }
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl != nullptr) {
+        dl->budget -= ran;
+      }
+    charge_group(tid, ran);
+    threads[tid].set_run_start(now);
+  }
+
+  void on_start_running(int tid) {
+    threads[tid].set_run_start(now_nsecs());
+    if (policy == UTHREAD_SCHED_FAIR and threads[tid].get_vruntime() > min_vruntime) {
+        min_vruntime = threads[tid].get_vruntime();
+      }
+    uint64_t cut = group_quota_left(tid); // the quantum ends early when a budget or a group quota runs out
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl != nullptr and (dl->budget <= 0 or (uint64_t) dl->budget < cut)) {
+        cut = dl->budget > 0 ? dl->budget : 0;
+      }
+    if (cut < slice_nsecs()) {
+        arm_timer(cut > 0 ? cut : 1);
+      }
+  }
+
+  /* Whether the deadline threads, with tid reserving runtime / deadline, fit in MAX_DEADLINE_BANDWIDTH. */
+  bool admits(int tid, uint64_t runtime, uint64_t deadline) const {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    uint64_t others = deadline_bandwidth - (dl != nullptr ? dl->bandwidth : 0);
+    return others + (runtime << BANDWIDTH_SHIFT) / deadline <= MAX_DEADLINE_BANDWIDTH;
+  }
+
+  /* Moves tid to the deadline class, or updates its reservation. A new period starts now. The thread must be off the
+     ready queue. */
+  void set_deadline(int tid, uint64_t runtime, uint64_t deadline, uint64_t period) {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl == nullptr) {
+        dl = pool_new<DeadlineParams>();
+        threads[tid].set_deadline(dl);
+      } else {
+        deadline_bandwidth -= dl->bandwidth;
+      }
+    dl->runtime = runtime;
+    dl->deadline = deadline;
+    dl->period = period;
+    dl->bandwidth = (runtime << BANDWIDTH_SHIFT) / deadline;
+    deadline_bandwidth += dl->bandwidth;
+    start_period(dl, now_nsecs());
+  }
+
+  /* Returns tid to its priority. The thread must be off the ready queue. */
+  void clear_deadline(int tid) {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl != nullptr) {
+        deadline_bandwidth -= dl->bandwidth;
+        threads[tid].set_deadline(nullptr);
+        pool_delete(dl);
+      }
+  }
+
+  void start_period(DeadlineParams *dl, uint64_t now) {
+    dl->abs_deadline = now + dl->deadline;
+    dl->budget = dl->runtime;
+  }
+
+  /* Puts a thread that used up its CPU time to sleep until wake_at, when the time is replenished. */
+  void sleep_throttled(int tid, uint64_t wake_at) {
+    TRACE(TRACE_SLEEP, tid);
+    threads[tid].set_state(BLOCKED);
+    threads[tid].set_flag(FLAG_SLEEPING | FLAG_TIMED_SLEEP | FLAG_THROTTLED);
+    threads[tid].set_wake_at(wake_at);
+    timed_sleepers.push(tid);
+    note_new_wait();
+  }
+
+  /* Puts a deadline thread to sleep until its next period starts, where its budget is replenished. */
+  void wait_next_period(int tid) {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    sleep_throttled(tid, dl->abs_deadline - dl->deadline + dl->period);
+  }
+
+  /* Budget enforcement: a deadline thread that used up its runtime sleeps until its next period, and a thread of a
+     group that used up its quota until the next period of the group. Returns whether tid was throttled. */
+  bool throttle(int tid) {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl != nullptr and dl->budget <= 0) {
+        wait_next_period(tid);
+        return true;
+      }
+    uint64_t until = group_throttled_until(tid);
+    if (until == 0) {
+        return false;
+      }
+    sleep_throttled(tid, until);
+    return true;
+  }
+
+  /* A new thread starts with the smallest virtual runtime, so it neither waits behind nor starves older threads. It
+     joins the group of the thread that spawns it. */
+  void place_new(int tid) {
+    threads[tid].set_vruntime(min_vruntime);
+    join_group(tid, running_thread != NO_TID ? threads[running_thread].get_group() : UTHREAD_GROUP_ROOT);
+  }
+
+  /* A deadline thread keeps its current deadline only if its remaining budget still fits before it at the reserved
+     bandwidth, otherwise a new period starts (the constant bandwidth server rule). Under the fair policy, a thread
+     that slept keeps its lag but gets at most half a quantum of credit, so sleeping cannot be used to bank CPU
+     time. */
+  void place_woken(int tid) {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    if (dl != nullptr) {
+        uint64_t now = now_nsecs();
+        if (now >= dl->abs_deadline
+            or dl->budget > (int64_t) (((dl->abs_deadline - now) * dl->bandwidth) >> BANDWIDTH_SHIFT)) {
+            start_period(dl, now);
+          }
+      }
+    if (policy != UTHREAD_SCHED_FAIR) {
+        return;
+      }
+    uint64_t credit = wakeup_granularity();
+    uint64_t floor = min_vruntime > credit ? min_vruntime - credit : 0;
+    if (threads[tid].get_vruntime() < floor) {
+        threads[tid].set_vruntime(floor);
+      }
+  }
+
+  /* Whether the running thread tid giving up the CPU lets another thread run: the first READY thread would not be
+     chosen after tid if tid has a higher priority. */
+  bool can_yield(int tid) const {
+    if (ready_q.empty()) {
+        return false;
+      }
+    int next = ready_q.front();
+    if (next == NO_TID or policy == UTHREAD_SCHED_FAIR or threads[next].get_deadline() != nullptr
+        or threads[tid].get_deadline() != nullptr) {
+        return true;
+      }
+    return threads[next].get_priority() >= threads[tid].get_priority();
+  }
+
+  /* Whether the READY thread tid should preempt the RUNNING thread other. */
+  bool outranks(int tid, int other) const {
+    DeadlineParams *dl = threads[tid].get_deadline();
+    DeadlineParams *other_dl = threads[other].get_deadline();
+    if (dl != nullptr or other_dl != nullptr) {
+        return dl != nullptr and (other_dl == nullptr or dl->abs_deadline < other_dl->abs_deadline);
+      }
+    if (policy == UTHREAD_SCHED_FAIR) {
+        return threads[tid].get_vruntime() + wakeup_granularity() < current_vruntime(other);
+      }
+    return threads[tid].get_priority() > threads[other].get_priority();
+  }
+
+  void on_quantum_start() {
+    if (policy == UTHREAD_SCHED_MLFQ and total_quantum_num % MLFQ_BOOST_PERIOD == 0) {
+        ready_q.boost();
+      }
+  }
+
+  int get_timer_source() const { return timer_source; }
+
+  void set_timer_source(int source) { timer_source = source; }
+
+  /* Whether the quantum timer of this worker is ITIMER_VIRTUAL, kept for the default source of a single worker. A
+     process-wide interval timer cannot serve several workers, and its resolution is the kernel tick. */
+  bool uses_itimer() const {
+    return workers[worker_index].timer_source == UTHREAD_TIMER_VIRTUAL and num_workers == 1;
+  }
+
+  /* Clock of the quantum timer for timer_source. Each of several workers counts its own CPU time. */
+  clockid_t timer_clock() const {
+    if (timer_source == UTHREAD_TIMER_MONOTONIC) {
+        return CLOCK_MONOTONIC;
+      }
+    return num_workers > 1 ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID;
+  }
+
+  /* Arms the quantum timer of this worker to expire in value nanoseconds and then every interval nanoseconds. Zero
+     stops it. */
+  void program_timer(uint64_t value, uint64_t interval) {
+    int failed;
+    if (uses_itimer()) {
+        itimerval time = {};
+        time.it_value.tv_sec = value / NSECS_PER_SEC;
+        time.it_value.tv_usec = value % NSECS_PER_SEC / NSECS_PER_USEC;
+        time.it_interval.tv_sec = interval / NSECS_PER_SEC;
+        time.it_interval.tv_usec = interval % NSECS_PER_SEC / NSECS_PER_USEC;
+        if (value > 0 and time.it_value.tv_sec == 0 and time.it_value.tv_usec == 0) {
+            time.it_value.tv_usec = 1;
+          }
+        failed = setitimer(ITIMER_VIRTUAL, &time, nullptr);
+      } else {
+        itimerspec time = {};
+        time.it_value.tv_sec = value / NSECS_PER_SEC;
+        time.it_value.tv_nsec = value % NSECS_PER_SEC;
+        time.it_interval.tv_sec = interval / NSECS_PER_SEC;
+        time.it_interval.tv_nsec = interval % NSECS_PER_SEC;
+        failed = timer_settime(workers[worker_index].timer, 0, &time, nullptr);
+      }
+    if (failed) {
+        std::cerr << "system error: timer error" << std::endl;
+        exit(1);
+      }
+  }
+
+  /* Cuts the current quantum short, to nsecs, so the budget of a deadline thread is enforced by the quantum timer.
+     The following periods are whole quantums again. */
+  void arm_timer(uint64_t nsecs) {
+    program_timer(nsecs, slice_nsecs());
+    tick_start = 0;
+  }
+
+  bool is_tickless() const { return timer_stopped; }
+
+  /* Stops the quantum timer of this worker while nothing can preempt the running thread, or while the worker idles
+     on a wall-clock timer. The quantum lasts until another thread becomes ready. */
+  void stop_timer() {
+    program_timer(0, 0);
+    tick_start = 0;
+    timer_stopped = true;
+  }
+
+  /* Whether the timer of an idle worker has to be stopped, since wall-clock time passes while it idles. */
+  bool ticks_while_idle() const {
+    return timer_source == UTHREAD_TIMER_MONOTONIC and !timer_stopped;
+  }
+
+  /* Starts a new quantum, moving the timer of this worker to the selected source first if it changed. */
+  void reset_timer() {
+    if (workers[worker_index].timer_source != timer_source) {
+        create_worker_timer();
+      }
+    uint64_t slice = slice_nsecs();
+    program_timer(slice, slice);
+    tick_start = now_nsecs();
+    tick_length = slice;
+    timer_stopped = false;
+  }
+
+  /* Gives the thread about to run a quantum, re-arming the timer only when needed: the current period is kept if
+     between half a quantum and a whole one is left in it, so most switches make no system call, and one that just
+     expired is whole. The thread is charged the rest of the period. What is left is measured on the wall clock, since
+     reading a CPU clock costs a system call; a kernel thread never uses more CPU time than wall-clock time, so under
+     the CPU sources at least that much is left. */
+  void renew_quantum() {
+    uint64_t start = tick_start;
+    if (start == 0 or workers[worker_index].timer_source != timer_source) {
+        reset_timer();
+        return;
+      }
+    uint64_t elapsed = now_nsecs() - start;
+    uint64_t left = elapsed < tick_length ? tick_length - elapsed : 0;
+    uint64_t slice = slice_nsecs();
+    if (left < slice / 2 or left > slice) {
+        reset_timer();
+      }
+  }
+
+  /* Creates the quantum timer of the calling worker on timer_source, replacing the one it had. The timer signals this
+     worker alone. */
+  void create_worker_timer() {
+    Worker &worker = workers[worker_index];
+    if (worker.timer_source == UTHREAD_TIMER_VIRTUAL and num_workers == 1) {
+        itimerval off = {};
+        setitimer(ITIMER_VIRTUAL, &off, nullptr);
+      } else if (worker.timer_source != NO_TIMER) {
+        timer_delete(worker.timer);
+      }
+    worker.timer_source = timer_source;
+    if (uses_itimer()) {
+        return;
+      }
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGVTALRM;
+    event.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(timer_clock(), &event, &worker.timer)) {
+        std::cerr << "system error: timer error" << std::endl;
+        exit(1);
+      }
+  }
+
+  void set_timer() {
+    sa.sa_sigaction = &on_timer_signal;
+    // The handler may switch to another thread before returning, so the signal must not stay blocked meanwhile.
+    // Reentrancy is prevented by the critical section flag instead.
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER | SA_RESTART;
+    if (sigaction(SIGVTALRM, &sa, nullptr) < 0) {
+        std::cerr << "system error: timer error" << std::endl;
+        exit(1);
+      }
+  }
+};
+
+
+Scheduler scheduler;
+
+/* Wakes up every sleeper whose time has come. Called once per quantum start, it costs O(1) when no thread wakes up
+   and O(log n) for each one that does. */
+void wake_sleepers() {
+  while (!quantum_sleepers.empty()
+         and threads[quantum_sleepers.top()].get_wake_at() <= (uint64_t) total_quantum_num) {
+      scheduler.place_woken(quantum_sleepers.top());
+      awake_thread(quantum_sleepers.top());
+    }
+  if (timed_sleepers.empty()) {
+      return;
+    }
+  uint64_t now = now_nsecs();
+  while (!timed_sleepers.empty() and threads[timed_sleepers.top()].get_wake_at() <= now) {
+      scheduler.place_woken(timed_sleepers.top());
+      awake_thread(timed_sleepers.top());
+    }
+}
+
+/* With several workers, threads only give up their worker at the end of a quantum. An idle worker has no thread
+   to preempt. */
+bool outranks(int tid, int other) {
+  return other != NO_TID and !ready_q.is_distributed() and scheduler.outranks(tid, other);
+}
+
+void cancel_select(ChanSelect *select);
+
+extern int epoll_fd;
+
+void admit_readers(uthread_rwlock *rwlock);
+
+/* Takes a terminated thread off the wait queue or the channels it is parked on, if any. A condition variable whose
+   last waiter leaves is no longer bound to their mutex. */
+void leave_wait_queue(int tid) {
+  if (threads[tid].has_flag(FLAG_WAITING)) {
+      ThreadQueue *queue = threads[tid].get_wait_queue();
+      queue->remove(tid);
+      if (threads[tid].has_flag(FLAG_COND_WAIT) and queue->empty()) {
+          auto *cond = reinterpret_cast<uthread_cond *>(reinterpret_cast<char *>(queue) - offsetof(uthread_cond, waiters));
+          cond->mutex = nullptr;
+        }
+      if (threads[tid].has_flag(FLAG_WRITE_WAIT) and queue->empty()) {
+          // The readers parked behind the last waiting writer no longer have to wait while others read.
+          auto *rwlock = reinterpret_cast<uthread_rwlock *>(reinterpret_cast<char *>(queue)
+                                                            - offsetof(uthread_rwlock, write_waiters));
+          if (rwlock->writer == NO_TID) {
+              admit_readers(rwlock);
+            }
+        }
+    } else if (threads[tid].has_flag(FLAG_SELECTING)) {
+      cancel_select(threads[tid].get_select());
+    }
+  if (threads[tid].has_flag(FLAG_IO)) {
+      io_parked--;
+    }
+  threads[tid].set_wait_queue(nullptr);
+  threads[tid].clear_flag(FLAG_WAITING | FLAG_COND_WAIT | FLAG_WRITE_WAIT | FLAG_SELECTING | FLAG_IO);
+}
+
+void poll_io();
+
+void run_task(int tid);
+
+int pick_next();
+
+bool deliver_exit_value(int tid);
+
+/* Releases a finished thread, or only its stack if it has to wait for uthread_join. */
+void release_finished(int tid) {
+  TRACE(TRACE_EXIT, tid);
+  if (!deliver_exit_value(tid)) {
+      release_tid(tid);
+      return;
+    }
+  threads[tid].clear_flag(FLAG_BLOCKED | FLAG_SLEEPING | FLAG_TIMED_SLEEP | FLAG_THROTTLED | FLAG_CANCELLED
+                          | FLAG_DYING);
+  threads[tid].set_flag(FLAG_EXITED);
+  threads[tid].set_state(BLOCKED);
+}
+
+/* Releases the thread that was running, which terminated. Its stack is still in use, and is released by the context
+   that runs next. The frame of a task is destroyed by the caller. */
+void retire(int tid) {
+  leave_wait_queue(tid);
+  if (!threads[tid].has_flag(FLAG_TASK)) {
+      dead_stack = threads[tid].get_stack();
+      dead_stack_size = threads[tid].get_stack_size();
+      dead_stack_guarded = !threads[tid].has_flag(FLAG_UNGUARDED);
+    }
+  release_finished(tid);
+}
+
+/* Puts the thread that was running back on the ready queue, unless it is a deadline thread that used up its
+   budget, or another worker blocked or terminated it meanwhile. */
+void requeue(int tid, bool at_front) {
+  if (threads[tid].has_flag(FLAG_CANCELLED)) {
+      retire(tid);
+      return;
+    }
+  if (threads[tid].has_flag(FLAG_BLOCKED)) {
+      threads[tid].set_state(BLOCKED);
+      return;
+    }
+  if (scheduler.throttle(tid)) {
+      return;
+    }
+  threads[tid].set_state(READY);
+  if (at_front) {
+      ready_q.push_front(tid);
+    } else {
+      ready_q.push_back(tid);
+    }
+}
+
+/* Whether tid, which was running, is the only thread that can run on the single worker: no other thread is ready,
+   none sleeps, none waits for I/O, and it has no deadline budget nor group quota to enforce. */
+bool runs_alone(int tid) {
+  return num_workers == 1 and ready_q.empty() and quantum_sleepers.empty() and timed_sleepers.empty()
+         and io_parked == 0 and threads[tid].get_deadline() == nullptr and group_quota_left(tid) == UINT64_MAX;
+}
+
+void restart_stopped_timer() {
+  if (scheduler.is_tickless()) {
+      scheduler.reset_timer();
+    }
+}
+
+/* Makes tid the running thread of this worker. */
+void start_running(int tid) {
+  TRACE(TRACE_RUN, tid);
+  running_thread = tid;
+  threads[tid].set_state(RUNNING);
+  threads[tid].set_running_on(worker_index);
+  threads[tid].increment_quantums();
+  scheduler.on_start_running(tid);
+}
+
+/* Switches from prev_thread to the head of the ready queue, or to the scheduling loop of the worker if nothing is
+   ready. */
+void switch_to_next_running(int prev_thread) {
+  if (task_running) {
+      std::cerr << "thread library error: a task cannot block, yield or terminate itself, it has to co_await" << std::endl;
+      exit(1);
+    }
+  reschedule_pending = 0;
+  int next_thread = pick_next();
+  if (next_thread != NO_TID and threads[next_thread].has_flag(FLAG_TASK)) { // it runs on the stack of the loop
+      next_task = next_thread;
+      next_thread = NO_TID;
+    }
+  if (next_thread != prev_thread and threads[prev_thread].has_flag(FLAG_USED)) {
+      check_stack_canary(prev_thread);
+    }
+  if (next_thread == NO_TID) {
+      running_thread = NO_TID;
+      uthreads_switch_context(threads[prev_thread].get_context(), workers[worker_index].idle_sp);
+      reap_dead_stack();
+      return;
+    }
+  start_running(next_thread);
+  if (next_thread != prev_thread) {
+      uthreads_switch_context(threads[prev_thread].get_context(), *threads[next_thread].get_context());
+      reap_dead_stack();
+    }
+}
+
+/* Nanoseconds until the first sleeper is due, or -1 if no thread sleeps. While the first worker idles, every quantum
+   of idle time counts as a quantum for the threads sleeping a number of quantums. */
+int64_t next_wake_in(uint64_t idle_nsecs) {
+  int64_t timeout = -1;
+  if (!timed_sleepers.empty()) {
+      uint64_t wake_at = threads[timed_sleepers.top()].get_wake_at();
+      uint64_t now = now_nsecs();
+      timeout = wake_at > now ? (int64_t) (wake_at - now) : 0;
+    }
+  if (!quantum_sleepers.empty() and worker_index == 0) {
+      uint64_t wake_at = threads[quantum_sleepers.top()].get_wake_at();
+      uint64_t quanta = wake_at > (uint64_t) total_quantum_num ? wake_at - total_quantum_num : 0;
+      int64_t quantum_timeout = (int64_t) (quanta * scheduler.get_quantum_nsecs()) - (int64_t) idle_nsecs;
+      quantum_timeout = quantum_timeout > 0 ? quantum_timeout : 0;
+      timeout = timeout < 0 or quantum_timeout < timeout ? quantum_timeout : timeout;
+    }
+  return timeout;
+}
+
+/* Suspends the worker for timeout nanoseconds, or until a descriptor is ready if poll_reactor is set. A negative
+   timeout waits for the descriptor alone. Returns whether the descriptor is ready. */
+bool wait_idle(int64_t timeout, bool poll_reactor) {
+  timespec pause = {(time_t) (timeout / (int64_t) NSECS_PER_SEC), (long) (timeout % (int64_t) NSECS_PER_SEC)};
+  pollfd reactor = {epoll_fd, POLLIN, 0};
+  return ppoll(&reactor, poll_reactor ? 1 : 0, timeout < 0 ? nullptr : &pause, nullptr) > 0;
+}
+
+/* Idles one of several workers, which holds no lock meanwhile, and looks for work in the deques of all the workers
+   between two waits, doubling the wait each time up to IDLE_MAX_BACKOFF_NSECS. Returns true once it took an entry.
+   Returns false once timeout passed or the descriptor is ready, as wait_idle would, or once waits_started moved past
+   waits_seen, read with timeout under the lock, so the worker only takes the lock again when it has something to
+   do. */
+bool steal_while_idle(int64_t timeout, bool poll_reactor, uint32_t waits_seen, long &backoff, uint64_t &entry) {
+  uint64_t due = timeout < 0 ? UINT64_MAX : now_nsecs() + timeout;
+  for (;;) {
+      uint64_t now = now_nsecs();
+      if (now >= due) {
+          return false;
+        }
+      bool backing_off = due - now > (uint64_t) backoff;
+      bool reactor_ready = wait_idle(backing_off ? backoff : (int64_t) (due - now), poll_reactor);
+      if (ready_q.steal_unlocked(entry)) {
+          return true;
+        }
+      if (reactor_ready or !backing_off or waits_started.load(std::memory_order_acquire) != waits_seen) {
+          return false;
+        }
+      backoff = backoff * 2 < IDLE_MAX_BACKOFF_NSECS ? backoff * 2 : IDLE_MAX_BACKOFF_NSECS;
+    }
+}
+
+/* Scheduling loop of a worker with nothing to run, on a stack of its own. It runs inside the critical section and
+   switches to any thread that became ready here or can be stolen elsewhere. In between, the worker sleeps until the
+   first sleeper is due or a descriptor some thread waits for is ready, so an idle process burns no CPU; with several
+   workers it also wakes up periodically to look for work to steal, which it does without the lock. */
+void worker_loop() {
+  TRACE(TRACE_RUN, NO_TID);
+  reap_dead_stack();
+  long backoff = IDLE_MIN_BACKOFF_NSECS;
+  uint64_t idle_nsecs = 0;
+  for (;;) {
+      wake_sleepers();
+      poll_io();
+      int tid = next_task != NO_TID ? next_task : pick_next();
+      next_task = NO_TID;
+      if (tid != NO_TID and threads[tid].has_flag(FLAG_TASK)) {
+          backoff = IDLE_MIN_BACKOFF_NSECS;
+          run_task(tid);
+          continue;
+        }
+      if (tid != NO_TID) {
+          backoff = IDLE_MIN_BACKOFF_NSECS;
+          preemption_pending = 0;
+          scheduler.renew_quantum();
+          start_running(tid);
+          uthreads_switch_context(&workers[worker_index].idle_sp, *threads[tid].get_context());
+          TRACE(TRACE_RUN, NO_TID);
+          reap_dead_stack();
+          continue;
+        }
+      if (scheduler.ticks_while_idle()) {
+          scheduler.stop_timer();
+        }
+      int64_t timeout = next_wake_in(idle_nsecs);
+      bool poll_reactor = io_parked > 0;
+      uint64_t idle_start = now_nsecs();
+      if (num_workers > 1) {
+          uint32_t waits_seen = waits_started.load(std::memory_order_relaxed);
+          sched_lock.unlock();
+          uint64_t entry;
+          bool stolen = steal_while_idle(timeout, poll_reactor, waits_seen, backoff, entry);
+          sched_lock.lock();
+          if (stolen) {
+              ready_q.adopt(entry);
+            }
+        } else {
+          wait_idle(timeout, poll_reactor);
+        }
+      uint64_t idled = now_nsecs() - idle_start;
+      idle_nsecs += idled;
+      sched_stats.idle_nsecs += idled;
+      if (worker_index == 0) {
+          total_quantum_num += (int) (idle_nsecs / scheduler.get_quantum_nsecs());
+          idle_nsecs %= scheduler.get_quantum_nsecs();
+        }
+    }
+}
+
+void *worker_main(void *index) {
+  worker_index = (int) (intptr_t) index;
+  running_thread = NO_TID;
+  in_critical_section = 1;
+  sigset_t timer_signal;
+  sigemptyset(&timer_signal);
+  sigaddset(&timer_signal, SIGVTALRM);
+  pthread_sigmask(SIG_UNBLOCK, &timer_signal, nullptr); // blocked by start_workers until the state above is set
+  sched_lock.lock();
+  scheduler.reset_timer();
+  worker_loop();
+  return nullptr;
+}
+
+/* Makes the worker running tid reach a scheduling decision now, so a block or terminate request from another worker
+   takes effect. */
+void preempt_worker_of(int tid) {
+  pthread_kill(workers[threads[tid].get_running_on()].pthread, SIGVTALRM);
+}
+
+/* First code run by every spawned thread, on its own stack. */
+void thread_trampoline() {
+  reap_dead_stack();
+  leave_critical_section();
+  threads[running_thread].get_entry_point()();
+  uthread_terminate(running_thread);
+}
+
+/* Signal handler of the quantum timer. The signal also comes from another worker that preempts this one, in which
+   case no period started. */
+void on_timer_signal(int sig, siginfo_t *info, void *) {
+  if (info->si_code != SI_TKILL and info->si_code != SI_USER) {
+      tick_start = now_nsecs();
+    }
+  timed_switch(sig);
+}
+
+/* Takes the running thread off the CPU for one of the SWITCH_* reasons, before the next one is chosen. */
+void switch_out(int reason, long amount) {
+  total_quantum_num++;
+  scheduler.on_quantum_start();
+  scheduler.charge_runtime(running_thread);
+  wake_sleepers();
+  int prev_thread = running_thread;
+  if (reason != SWITCH_TERMINATE) {
+      record_switch(prev_thread, reason != SWITCH_PREEMPT);
+    }
+  if (reason == SWITCH_BLOCK) {
+      scheduler.on_voluntary_switch(prev_thread);
+      threads[prev_thread].set_state(BLOCKED);
+      threads[prev_thread].set_flag(FLAG_BLOCKED);
+    } else if (reason == SWITCH_SLEEP) {
+      TRACE(TRACE_SLEEP, prev_thread);
+      scheduler.on_voluntary_switch(prev_thread);
+      threads[prev_thread].set_state(BLOCKED);
+      threads[prev_thread].set_flag(FLAG_SLEEPING);
+      threads[prev_thread].set_wake_at(total_quantum_num + amount);
+      quantum_sleepers.push(prev_thread);
+      note_new_wait();
+    } else if (reason == SWITCH_SLEEP_USECS) {
+      TRACE(TRACE_SLEEP, prev_thread);
+      scheduler.on_voluntary_switch(prev_thread);
+      threads[prev_thread].set_state(BLOCKED);
+      threads[prev_thread].set_flag(FLAG_SLEEPING | FLAG_TIMED_SLEEP);
+      threads[prev_thread].set_wake_at(now_nsecs() + amount * NSECS_PER_USEC);
+      timed_sleepers.push(prev_thread);
+      note_new_wait();
+    } else if (reason == SWITCH_PARK) {
+      TRACE(TRACE_PARK, prev_thread);
+      scheduler.on_voluntary_switch(prev_thread);
+      threads[prev_thread].set_state(BLOCKED);
+    } else if (reason == SWITCH_WAIT_PERIOD) {
+      scheduler.on_voluntary_switch(prev_thread);
+      scheduler.wait_next_period(prev_thread);
+    } else if (reason == SWITCH_TERMINATE) {
+      retire(prev_thread);
+    } else {
+      requeue(prev_thread, reason == SWITCH_PREEMPT);
+    }
+  poll_io(); // after prev_thread parked, since an event may already be pending for it
+}
+
+/* Makes a scheduling decision on behalf of the running thread, for one of the SWITCH_* reasons. Must be called inside
+   a critical section, which is left once the calling thread runs again. */
+void forced_switch(int reason, long amount) {
+  if (threads[running_thread].has_flag(FLAG_CANCELLED)) {
+      reason = SWITCH_TERMINATE;
+    }
+  int prev_thread = running_thread;
+  switch_out(reason, amount);
+  scheduler.renew_quantum();
+  switch_to_next_running(prev_thread);
+  leave_critical_section();
+}
+
+
+void timed_switch(int sig) {
+  if (in_critical_section or task_running) {
+      preemption_pending = 1;
+      return;
+    }
+  int saved_errno = errno;
+  enter_critical_section();
+  preemption_pending = 0;
+  total_quantum_num++;
+  scheduler.on_quantum_start();
+  scheduler.charge_runtime(running_thread);
+  wake_sleepers();
+  poll_io();
+  int prev_thread = running_thread;
+  record_switch(prev_thread, false);
+  scheduler.on_quantum_expired(prev_thread);
+  // A thread whose quantum expired while it ran alone goes on without the timer, until another thread is made
+  // ready. Stopping it on the expiry rather than when the thread starts keeps threads that hand the CPU to each
+  // other from stopping and restarting it on every switch.
+  bool alone = runs_alone(prev_thread);
+  requeue(prev_thread, false);
+  if (alone) {
+      scheduler.stop_timer();
+    } else {
+      scheduler.renew_quantum();
+    }
+  switch_to_next_running(prev_thread);
+  leave_critical_section();
+  errno = saved_errno;
+}
+
+/* Fast path of uthread_yield. Besides the reasons forced_switch handles, it leaves the due sleepers and the ready
+   descriptors to the next timer expiry, which comes within a quantum since the timer is never stopped while a thread
+   sleeps or waits for I/O. The thread that runs next keeps the current timer period, as after any switch. */
+void yield_switch() {
+  total_quantum_num++;
+  scheduler.on_quantum_start();
+  scheduler.charge_runtime(running_thread);
+  int prev_thread = running_thread;
+  record_switch(prev_thread, true);
+  scheduler.on_voluntary_switch(prev_thread);
+  requeue(prev_thread, false);
+  scheduler.renew_quantum();
+  switch_to_next_running(prev_thread);
+  leave_critical_section();
+}
+
+
+// --- uthread library implementation ---
+
+int uthread_init(int quantum_usecs) {
+  return uthread_init_policy(quantum_usecs, UTHREAD_SCHED_RR);
+}
+
+/* Runs the first worker's scheduling loop on a stack of its own, since the main thread owns the process stack, and
+   starts the other workers, if any. */
+void start_workers(int count) {
+  void *memory = nullptr;
+  if (posix_memalign(&memory, alignof(Worker), count * sizeof(Worker))) {
+      std::cerr << "system error: Memory allocation fails" << std::endl;
+      exit(1);
+    }
+  workers = (Worker *) memory;
+  for (int i = 0; i < count; i++) {
+      new (&workers[i]) Worker();
+#ifdef UTHREADS_TRACE
+      workers[i].trace = new TraceEvent[TRACE_EVENTS];
+#endif
+    }
+#ifdef UTHREADS_TRACE
+  trace_start_tsc = __builtin_ia32_rdtsc();
+  trace_start_nsecs = now_nsecs();
+  TRACE(TRACE_RUN, 0);
+#endif
+  workers[0].pthread = pthread_self();
+  bool guarded;
+  char *idle_stack = map_stack(IDLE_STACK_SIZE, guarded);
+  workers[0].idle_sp = make_initial_frame(idle_stack, IDLE_STACK_SIZE, &worker_loop);
+  scheduler.reset_timer();
+  if (count == 1) {
+      return;
+    }
+  ready_q.set_distributed(true);
+  // A worker may be sent SIGVTALRM, by uthread_set_timer for one, before it has set its worker-local state, which
+  // would have the handler take it for the first worker. The workers start with the signal blocked instead, and
+  // worker_main unblocks it.
+  sigset_t timer_signal, saved_mask;
+  sigemptyset(&timer_signal);
+  sigaddset(&timer_signal, SIGVTALRM);
+  pthread_sigmask(SIG_BLOCK, &timer_signal, &saved_mask);
+  for (int i = 1; i < count; i++) {
+      if (pthread_create(&workers[i].pthread, nullptr, &worker_main, (void *) (intptr_t) i)) {
+          std::cerr << "system error: worker creation fails" << std::endl;
+          exit(1);
+        }
+    }
+  pthread_sigmask(SIG_SETMASK, &saved_mask, nullptr);
+}
+
+int init_library(int quantum_usecs, int policy, int count) {
+
+  if (quantum_usecs <= 0) {
+      std::cerr << "thread library error: invalid quantum_usecs" << std::endl;
+      return -1;
+    }
+  if (policy != UTHREAD_SCHED_RR and policy != UTHREAD_SCHED_MLFQ and policy != UTHREAD_SCHED_FAIR) {
+      std::cerr << "thread library error: invalid scheduling policy" << std::endl;
+      return -1;
+    }
+  page_size = sysconf(_SC_PAGESIZE);
+  max_guarded_stacks = read_max_guarded_stacks();
+  num_workers = count; // before the timers are created, which are per worker with several
+  scheduler = *new Scheduler(quantum_usecs, policy);
+  ready_q.set_fair(policy == UTHREAD_SCHED_FAIR);
+  scheduler.set_timer();
+  allocate_tid(); // tid 0 belongs to the main thread
+  threads[0].init(0, nullptr, nullptr, 0);
+  threads[0].set_state(RUNNING);
+  threads[0].increment_quantums();
+  running_thread = 0;
+  scheduler.on_start_running(0);
+  total_quantum_num = 1;
+  start_workers(count);
+  return EXIT_SUCCESS;
+}
+
+int uthread_init_policy(int quantum_usecs, int policy) {
+  return init_library(quantum_usecs, policy, 1);
+}
+
+int uthread_init_workers(int quantum_usecs, int num_workers) {
+  if (num_workers < 1 or num_workers > MAX_WORKERS) {
+      std::cerr << "thread library error: invalid number of workers" << std::endl;
+      return -1;
+    }
+  return init_library(quantum_usecs, UTHREAD_SCHED_RR, num_workers);
+}
+
+size_t round_to_pages(int stack_size) {
+  return (stack_size + page_size - 1) & ~(page_size - 1);
+}
+
+bool is_valid_priority(int priority) {
+  return priority >= 0 and priority < UTHREAD_PRIO_LEVELS;
+}
+
+int spawn_thread(thread_entry_point entry_point, int stack_size, int priority, JoinState *join = nullptr) {
+  enter_critical_section();
+  if (entry_point == nullptr){
+      std::cerr << "thread library error: thread cannot get nullptr as entry_point" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (stack_size <= 0) {
+      std::cerr << "thread library error: stack_size must be positive" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (!is_valid_priority(priority)) {
+      std::cerr << "thread library error: invalid priority" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int tid = allocate_tid();
+  if (tid == NO_TID) {
+      std::cerr << "thread library error: you reached the max number of threads" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+
+  size_t rounded_size = round_to_pages(stack_size);
+  bool guarded;
+  char *stack = allocate_stack(rounded_size, guarded);
+  threads[tid].init(tid, entry_point, stack, rounded_size);
+  if (!guarded) {
+      *(uint64_t *) stack = STACK_CANARY;
+      threads[tid].set_flag(FLAG_UNGUARDED);
+    }
+  threads[tid].set_base_priority(priority);
+  threads[tid].set_priority(priority);
+  if (join != nullptr) {
+      threads[tid].set_join(join);
+      threads[tid].set_flag(FLAG_JOINABLE);
+    }
+  scheduler.place_new(tid);
+  TRACE(TRACE_SPAWN, tid);
+  make_ready(tid);
+  leave_critical_section();
+  return tid;
+}
+
+int uthread_spawn(thread_entry_point entry_point) {
+  return spawn_thread(entry_point, STACK_SIZE, UTHREAD_PRIO_DEFAULT);
+}
+
+int uthread_spawn_stack(thread_entry_point entry_point, int stack_size) {
+  return spawn_thread(entry_point, stack_size, UTHREAD_PRIO_DEFAULT);
+}
+
+int uthread_spawn_prio(thread_entry_point entry_point, int priority) {
+  return spawn_thread(entry_point, STACK_SIZE, priority);
+}
+
+/* Entry point of the threads spawned by uthread_spawn_arg. */
+void run_arg_entry_point() {
+  JoinState *join = threads[uthread_get_tid()].get_join();
+  uthread_exit(join->entry_point(join->arg));
+}
+
+int uthread_spawn_arg(thread_arg_entry_point entry_point, void *arg) {
+  return uthread_spawn_arg_stack(entry_point, arg, STACK_SIZE);
+}
+
+int uthread_spawn_arg_stack(thread_arg_entry_point entry_point, void *arg, int stack_size) {
+  if (entry_point == nullptr) {
+      std::cerr << "thread library error: thread cannot get nullptr as entry_point" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  JoinState *join = pool_new<JoinState>(JoinState{entry_point, arg, nullptr, nullptr, nullptr});
+  leave_critical_section();
+  int tid = spawn_thread(&run_arg_entry_point, stack_size, UTHREAD_PRIO_DEFAULT, join);
+  if (tid < 0) {
+      enter_critical_section();
+      pool_delete(join);
+      leave_critical_section();
+    }
+  return tid;
+}
+
+/* Destroys the frame of a task another thread terminated, which was not running. The destructors of its locals run
+   outside the critical section, while the task still owns its tid and its arena: it is dying meanwhile, so no other
+   call reaches it, and the blocks it allocated are freed to its arena. Called in the critical section, which is
+   kept. */
+void destroy_task_frame(int tid) {
+  if (threads[tid].get_state() == READY) {
+      threads[tid].set_state(BLOCKED);
+    }
+  threads[tid].set_flag(FLAG_DYING);
+  leave_critical_section();
+  destroy_coroutine(threads[tid].get_frame());
+  enter_critical_section();
+}
+
+int uthread_terminate(int tid) {
+  if (tid == running_thread and tid != 0 and !task_running) {
+      run_specific_destructors();
+    }
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      leave_critical_section();
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      return -1;
+    }
+
+  if (tid == 0) {
+      close_program();
+    }
+  if (tid == running_thread and task_running) {
+      std::cerr << "thread library error: a task cannot terminate itself, it ends by returning" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (tid == running_thread) {
+      scheduler.clear_deadline(tid);
+      forced_switch(SWITCH_TERMINATE);
+      return EXIT_SUCCESS;
+    }
+  if (threads[tid].get_state() == RUNNING) { // on another worker
+      threads[tid].set_flag(FLAG_CANCELLED);
+      preempt_worker_of(tid);
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  if (threads[tid].get_state() == READY) {
+      ready_q.remove(tid);
+    }
+  scheduler.clear_deadline(tid);
+
+  if (threads[tid].has_flag(FLAG_SLEEPING)) {
+      sleep_heap_of(tid).remove(tid);
+    }
+  leave_wait_queue(tid);
+  if (threads[tid].has_flag(FLAG_TASK)) {
+      destroy_task_frame(tid);
+    } else {
+      free_stack(threads[tid].get_stack(), threads[tid].get_stack_size(), !threads[tid].has_flag(FLAG_UNGUARDED));
+    }
+  release_finished(tid);
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+void close_program() {
+  exit(0);
+}
+
+int uthread_block(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (tid == 0) {
+      std::cerr << "thread library error: main thread cannot be blocked" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  TRACE(TRACE_BLOCK, tid);
+
+  if (threads[tid].get_state() == READY) {
+      ready_q.remove(tid);
+    }
+
+  if (tid == running_thread) {
+      forced_switch(SWITCH_BLOCK);
+      return EXIT_SUCCESS;
+    }
+  if (threads[tid].get_state() == RUNNING) { // on another worker, it stops at its next switch
+      threads[tid].set_flag(FLAG_BLOCKED);
+      preempt_worker_of(tid);
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  threads[tid].set_state(BLOCKED);
+  threads[tid].set_flag(FLAG_BLOCKED);
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_resume(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) { //tid is not exist
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  Thread &curr_thread = threads[tid];
+  TRACE(TRACE_RESUME, tid);
+
+  // Still sleeping or parked, or running on another worker that did not stop it yet.
+  if (curr_thread.has_flag(FLAG_BLOCKED)
+      and (curr_thread.has_flag(FLAG_SLEEPING | FLAG_WAITING | FLAG_SELECTING)
+           or curr_thread.get_state() == RUNNING))
+    {
+      curr_thread.clear_flag(FLAG_BLOCKED);
+    } else if (curr_thread.has_flag(FLAG_BLOCKED)) {
+      curr_thread.clear_flag(FLAG_BLOCKED);
+      scheduler.place_woken(tid);
+      make_ready(tid);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_yield() {
+  enter_critical_section();
+  if (!scheduler.can_yield(running_thread)) {
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  yield_switch();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_sleep(int num_quantums) {
+  enter_critical_section();
+  if (running_thread == 0) {
+      std::cerr << "thread library error: main thread can't call uthread_sleep function" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (num_quantums <= 0) {
+      std::cerr << "thread library error: num_quantums must be positive" << std::endl; //TODO - is it?
+      leave_critical_section();
+      return -1;
+    }
+  forced_switch(SWITCH_SLEEP, num_quantums);
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_sleep_usecs(int usecs) {
+  enter_critical_section();
+  if (running_thread == 0) {
+      std::cerr << "thread library error: main thread can't call uthread_sleep_usecs function" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (usecs <= 0) {
+      std::cerr << "thread library error: usecs must be positive" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  forced_switch(SWITCH_SLEEP_USECS, usecs);
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_get_tid() {
+  return running_thread;
+}
+
+int uthread_get_total_quantums() {
+  return total_quantum_num;
+}
+
+
+int uthread_get_quantums(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int quantums = threads[tid].get_thread_quantums();
+  leave_critical_section();
+  return quantums;
+}
+
+
+long long uthread_get_runtime_nsecs(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  uint64_t runtime = threads[tid].get_runtime();
+  if (threads[tid].get_state() == RUNNING) {
+      runtime += now_nsecs() - threads[tid].get_run_start();
+    }
+  leave_critical_section();
+  return (long long) runtime;
+}
+
+
+int uthread_set_adaptive_quantum(int target_latency_usecs, int min_granularity_usecs) {
+  if (target_latency_usecs < 0 or min_granularity_usecs < 0 or min_granularity_usecs > target_latency_usecs
+      or (target_latency_usecs > 0 and min_granularity_usecs == 0)) {
+      std::cerr << "thread library error: invalid adaptive quantum parameters" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  scheduler.set_adaptive(target_latency_usecs * NSECS_PER_USEC, min_granularity_usecs * NSECS_PER_USEC);
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_set_timer(int source) {
+  if (source != UTHREAD_TIMER_VIRTUAL and source != UTHREAD_TIMER_CPU and source != UTHREAD_TIMER_MONOTONIC) {
+      std::cerr << "thread library error: invalid timer source" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  scheduler.set_timer_source(source);
+  scheduler.reset_timer();
+  for (int i = 0; i < num_workers; i++) { // the others move their timer at the switch this forces
+      if (i != worker_index) {
+          pthread_kill(workers[i].pthread, SIGVTALRM);
+        }
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_set_priority(int tid, int priority) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (!is_valid_priority(priority)) {
+      std::cerr << "thread library error: invalid priority" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  Thread &thread = threads[tid];
+  if (thread.get_state() == READY) {
+      ready_q.remove(tid);
+    }
+  scheduler.charge_runtime(running_thread); // the running thread is charged at its old weight
+  thread.set_base_priority(priority);
+  thread.set_priority(priority);
+  if (thread.get_state() == READY) {
+      make_ready(tid);
+    } else if (thread.get_state() == RUNNING and !ready_q.empty() and outranks(ready_q.front(), tid)) {
+      reschedule_pending = 1;
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_get_priority(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int priority = threads[tid].get_priority();
+  leave_critical_section();
+  return priority;
+}
+
+
+
+int uthread_set_deadline(int tid, int runtime_usecs, int deadline_usecs, int period_usecs) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (tid == 0) {
+      std::cerr << "thread library error: main thread can't be a deadline thread" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (num_workers > 1) {
+      std::cerr << "thread library error: deadline threads need a single worker" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (runtime_usecs < 0 or (runtime_usecs > 0 and (deadline_usecs < runtime_usecs or period_usecs < deadline_usecs))) {
+      std::cerr << "thread library error: invalid deadline parameters" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  uint64_t runtime = (uint64_t) runtime_usecs * NSECS_PER_USEC;
+  uint64_t deadline = (uint64_t) deadline_usecs * NSECS_PER_USEC;
+  if (runtime_usecs > 0 and !scheduler.admits(tid, runtime, deadline)) {
+      std::cerr << "thread library error: deadline threads would exceed the CPU bandwidth" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  Thread &thread = threads[tid];
+  if (thread.get_state() == READY) {
+      ready_q.remove(tid);
+    } else if (thread.get_state() == RUNNING) {
+      scheduler.charge_runtime(tid);
+    }
+  if (runtime_usecs == 0) {
+      scheduler.clear_deadline(tid);
+    } else {
+      scheduler.set_deadline(tid, runtime, deadline, (uint64_t) period_usecs * NSECS_PER_USEC);
+    }
+  if (thread.get_state() == READY) {
+      make_ready(tid);
+    } else if (thread.has_flag(FLAG_THROTTLED)) { // its old period no longer applies
+      awake_thread(tid);
+    } else if (thread.get_state() == RUNNING) {
+      scheduler.on_start_running(tid);
+      if (!ready_q.empty() and outranks(ready_q.front(), tid)) {
+          reschedule_pending = 1;
+        }
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_wait_period() {
+  enter_critical_section();
+  if (threads[running_thread].get_deadline() == nullptr) {
+      std::cerr << "thread library error: only a deadline thread can wait for its period" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  forced_switch(SWITCH_WAIT_PERIOD);
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_migrate(int tid, int worker) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (worker != UTHREAD_ANY_WORKER and (worker < 0 or worker >= num_workers)) {
+      std::cerr << "thread library error: invalid worker" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  Thread &thread = threads[tid];
+  if (worker == UTHREAD_ANY_WORKER) {
+      thread.clear_flag(FLAG_PINNED);
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  thread.set_flag(FLAG_PINNED);
+  if (thread.get_state() == READY) {
+      ready_q.remove(tid);
+      thread.set_worker(worker);
+      ready_q.push_back(tid);
+    } else {
+      thread.set_worker(worker);
+    }
+  if (tid == running_thread and worker != worker_index) {
+      forced_switch(SWITCH_YIELD);
+      return EXIT_SUCCESS;
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_get_worker() {
+  return worker_index;
+}
+
+int uthread_pool_reserve(int num_stacks, int stack_size) {
+  enter_critical_section();
+  if (num_stacks < 0 or stack_size <= 0) {
+      std::cerr << "thread library error: invalid stack pool reservation" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  size_t rounded_size = round_to_pages(stack_size);
+  for (int i = 0; i < num_stacks; i++) {
+      bool guarded;
+      char *stack = map_stack(rounded_size, guarded);
+      if (!stack_pool.give(stack, rounded_size, guarded)) {
+          unmap_stack(stack, rounded_size);
+          std::cerr << "thread library error: stack pool is full" << std::endl;
+          leave_critical_section();
+          return -1;
+        }
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_pool_set_limit(int max_cached_stacks) {
+  enter_critical_section();
+  if (max_cached_stacks < 0 and max_cached_stacks != NO_LIMIT) {
+      std::cerr << "thread library error: invalid stack pool limit" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  stack_pool.set_limit(max_cached_stacks);
+  if (max_cached_stacks != NO_LIMIT) {
+      stack_pool.trim(max_cached_stacks);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_pool_trim(int keep) {
+  enter_critical_section();
+  if (keep < 0) {
+      std::cerr << "thread library error: keep must be non-negative" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int released = stack_pool.trim(keep);
+  leave_critical_section();
+  return released;
+}
+
+
+int uthread_get_memory_stats(uthread_memory_stats *stats) {
+  if (stats == nullptr) {
+      std::cerr << "thread library error: stats cannot be nullptr" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  stats->threads = num_threads;
+  stats->table_bytes = threads.allocated_bytes();
+  stats->mapped_stack_bytes = mapped_stack_bytes;
+  stats->cached_stacks = stack_pool.get_cached();
+  stats->mapped_arena_bytes = mapped_arena_bytes;
+  stats->resident_stack_bytes = 0;
+  unsigned char residency[RESIDENCY_PAGES];
+  for (int tid = 1; tid < threads.capacity(); tid++) {
+      if (!is_valid_tid(tid) or threads[tid].has_flag(FLAG_TASK)) {
+          continue;
+        }
+      size_t pages = threads[tid].get_stack_size() / page_size;
+      for (size_t first = 0; first < pages; first += RESIDENCY_PAGES) {
+          size_t count = pages - first < RESIDENCY_PAGES ? pages - first : RESIDENCY_PAGES;
+          if (mincore(threads[tid].get_stack() + first * page_size, count * page_size, residency)) {
+              std::cerr << "system error: mincore fails" << std::endl;
+              exit(1);
+            }
+          for (size_t page = 0; page < count; page++) {
+              stats->resident_stack_bytes += (residency[page] & 1) * page_size;
+            }
+        }
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_get_stats(int tid, uthread_stats *stats) {
+  if (stats == nullptr) {
+      std::cerr << "thread library error: stats cannot be nullptr" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  ThreadStats &thread_stats = threads.stats(tid);
+  uint64_t now = now_nsecs();
+  uint64_t current = now - thread_stats.since; // spent in the current state so far
+  stats->cpu_nsecs = threads[tid].get_runtime();
+  stats->ready_wait_nsecs = thread_stats.ready_wait_nsecs;
+  stats->sleep_nsecs = thread_stats.sleep_nsecs;
+  stats->block_nsecs = thread_stats.block_nsecs;
+  if (threads[tid].get_state() == RUNNING) {
+      stats->cpu_nsecs += now - threads[tid].get_run_start();
+    } else if (threads[tid].get_state() == READY) {
+      stats->ready_wait_nsecs += current;
+    } else if (threads[tid].has_flag(FLAG_SLEEPING)) {
+      stats->sleep_nsecs += current;
+    } else {
+      stats->block_nsecs += current;
+    }
+  stats->voluntary_switches = thread_stats.voluntary_switches;
+  stats->involuntary_switches = thread_stats.involuntary_switches;
+  stats->max_latency_nsecs = thread_stats.max_latency_nsecs;
+  for (int i = 0; i < UTHREAD_LATENCY_BUCKETS; i++) {
+      stats->latency_histogram[i] = thread_stats.latency_histogram[i];
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_get_sched_stats(uthread_sched_stats *stats) {
+  if (stats == nullptr) {
+      std::cerr << "thread library error: stats cannot be nullptr" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  stats->threads = num_threads;
+  stats->running = sched_stats.by_state[RUNNING];
+  stats->ready = sched_stats.by_state[READY];
+  stats->blocked = sched_stats.by_state[BLOCKED];
+  stats->total_quantums = total_quantum_num;
+  stats->voluntary_switches = sched_stats.voluntary_switches;
+  stats->involuntary_switches = sched_stats.involuntary_switches;
+  stats->ready_wait_nsecs = sched_stats.ready_wait_nsecs;
+  stats->idle_nsecs = sched_stats.idle_nsecs;
+  stats->max_latency_nsecs = sched_stats.max_latency_nsecs;
+  for (int i = 0; i < UTHREAD_LATENCY_BUCKETS; i++) {
+      stats->latency_histogram[i] = sched_stats.latency_histogram[i];
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+// --- synchronization primitives ---
+
+ThreadQueue &queue_of(uthread_wait_queue &waiters) {
+  return *reinterpret_cast<ThreadQueue *>(&waiters);
+}
+
+/* Appends the running thread to a wait queue. It stops running at the next forced_switch(SWITCH_PARK), or leaves the
+   queue at once if that switch turns out to terminate it. */
+void enqueue_running(ThreadQueue &queue) {
+  queue.push_back(running_thread);
+  threads[running_thread].set_wait_queue(&queue);
+  threads[running_thread].set_flag(FLAG_WAITING);
+}
+
+/* Makes a parked thread READY, unless it was also blocked with uthread_block. */
+void unpark(int tid) {
+  TRACE(TRACE_WAKE, tid);
+  threads[tid].set_wait_queue(nullptr);
+  threads[tid].clear_flag(FLAG_WAITING | FLAG_COND_WAIT | FLAG_WRITE_WAIT | FLAG_SELECTING | FLAG_IO);
+  if (!threads[tid].has_flag(FLAG_BLOCKED)) {
+      scheduler.place_woken(tid);
+      make_ready(tid);
+    }
+}
+
+/* Releases a mutex the running thread holds. Ownership goes straight to the first waiter, so it cannot be taken by a
+   thread that arrives before the waiter runs. */
+void release_mutex(uthread_mutex *mutex) {
+  ThreadQueue &waiters = queue_of(mutex->waiters);
+  if (waiters.empty()) {
+      mutex->owner = NO_TID;
+      return;
+    }
+  mutex->owner = waiters.pop_front();
+  unpark(mutex->owner);
+}
+
+
+int uthread_mutex_init(uthread_mutex *mutex) {
+  if (mutex == nullptr) {
+      std::cerr << "thread library error: mutex cannot be nullptr" << std::endl;
+      return -1;
+    }
+  uthread_mutex initial = UTHREAD_MUTEX_INITIALIZER;
+  *mutex = initial;
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_mutex_lock(uthread_mutex *mutex) {
+  enter_critical_section();
+  if (mutex == nullptr or mutex->owner == running_thread) {
+      std::cerr << "thread library error: invalid mutex or mutex already held" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (mutex->owner == NO_TID) {
+      mutex->owner = running_thread;
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  enqueue_running(queue_of(mutex->waiters));
+  forced_switch(SWITCH_PARK); // returns once release_mutex handed the mutex over
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_mutex_trylock(uthread_mutex *mutex) {
+  enter_critical_section();
+  if (mutex == nullptr) {
+      std::cerr << "thread library error: mutex cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int busy = mutex->owner != NO_TID;
+  if (!busy) {
+      mutex->owner = running_thread;
+    }
+  leave_critical_section();
+  return busy;
+}
+
+
+int uthread_mutex_unlock(uthread_mutex *mutex) {
+  enter_critical_section();
+  if (mutex == nullptr or mutex->owner != running_thread) {
+      std::cerr << "thread library error: mutex is not held by the calling thread" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  release_mutex(mutex);
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_cond_init(uthread_cond *cond) {
+  if (cond == nullptr) {
+      std::cerr << "thread library error: condition variable cannot be nullptr" << std::endl;
+      return -1;
+    }
+  uthread_cond initial = UTHREAD_COND_INITIALIZER;
+  *cond = initial;
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_cond_wait(uthread_cond *cond, uthread_mutex *mutex) {
+  enter_critical_section();
+  if (cond == nullptr or mutex == nullptr or mutex->owner != running_thread) {
+      std::cerr << "thread library error: cond_wait needs a mutex held by the calling thread" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (cond->mutex != nullptr and cond->mutex != mutex) {
+      std::cerr << "thread library error: all waiters of a condition variable must use the same mutex" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  cond->mutex = mutex;
+  enqueue_running(queue_of(cond->waiters));
+  threads[running_thread].set_flag(FLAG_COND_WAIT);
+  release_mutex(mutex);
+  forced_switch(SWITCH_PARK); // returns once signalled and holding the mutex again
+  return EXIT_SUCCESS;
+}
+
+/* Moves the first waiter of cond to its mutex: it gets the mutex at once if it is free, and otherwise waits for it
+   without running in between. */
+void signal_one(uthread_cond *cond) {
+  ThreadQueue &waiters = queue_of(cond->waiters);
+  int tid = waiters.pop_front();
+  uthread_mutex *mutex = cond->mutex;
+  if (waiters.empty()) {
+      cond->mutex = nullptr;
+    }
+  if (mutex->owner == NO_TID) {
+      mutex->owner = tid;
+      unpark(tid);
+    } else {
+      queue_of(mutex->waiters).push_back(tid);
+      threads[tid].set_wait_queue(&queue_of(mutex->waiters));
+      threads[tid].clear_flag(FLAG_COND_WAIT);
+    }
+}
+
+
+int uthread_cond_signal(uthread_cond *cond) {
+  enter_critical_section();
+  if (cond == nullptr) {
+      std::cerr << "thread library error: condition variable cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (!queue_of(cond->waiters).empty()) {
+      signal_one(cond);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_cond_broadcast(uthread_cond *cond) {
+  enter_critical_section();
+  if (cond == nullptr) {
+      std::cerr << "thread library error: condition variable cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  while (!queue_of(cond->waiters).empty()) {
+      signal_one(cond);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_sem_init(uthread_sem *sem, int value) {
+  if (sem == nullptr or value < 0) {
+      std::cerr << "thread library error: invalid semaphore" << std::endl;
+      return -1;
+    }
+  uthread_sem initial = UTHREAD_SEM_INITIALIZER(value);
+  *sem = initial;
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_sem_wait(uthread_sem *sem) {
+  enter_critical_section();
+  if (sem == nullptr) {
+      std::cerr << "thread library error: semaphore cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (sem->value > 0) {
+      sem->value--;
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  enqueue_running(queue_of(sem->waiters));
+  forced_switch(SWITCH_PARK); // returns once uthread_sem_post passed its unit over
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_sem_trywait(uthread_sem *sem) {
+  enter_critical_section();
+  if (sem == nullptr) {
+      std::cerr << "thread library error: semaphore cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  int busy = sem->value == 0;
+  if (!busy) {
+      sem->value--;
+    }
+  leave_critical_section();
+  return busy;
+}
+
+
+int uthread_sem_post(uthread_sem *sem) {
+  enter_critical_section();
+  if (sem == nullptr) {
+      std::cerr << "thread library error: semaphore cannot be nullptr" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  ThreadQueue &waiters = queue_of(sem->waiters);
+  if (waiters.empty()) {
+      sem->value++;
+    } else {
+      unpark(waiters.pop_front());
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_rwlock_init(uthread_rwlock *rwlock) {
+  if (rwlock == nullptr) {
+      std::cerr << "thread library error: rwlock cannot be nullptr" << std::endl;
+      return -1;
+    }
+  uthread_rwlock initial = UTHREAD_RWLOCK_INITIALIZER;
+  *rwlock = initial;
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_rwlock_rdlock(uthread_rwlock *rwlock) {
+  enter_critical_section();
+  if (rwlock == nullptr or rwlock->writer == running_thread) {
+      std::cerr << "thread library error: invalid rwlock or rwlock already held for writing" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  // A waiting writer holds back new readers, so a stream of readers cannot starve it.
+  if (rwlock->writer == NO_TID and queue_of(rwlock->write_waiters).empty()) {
+      rwlock->readers++;
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  enqueue_running(queue_of(rwlock->read_waiters));
+  forced_switch(SWITCH_PARK); // returns once admitted as a reader
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_rwlock_wrlock(uthread_rwlock *rwlock) {
+  enter_critical_section();
+  if (rwlock == nullptr or rwlock->writer == running_thread) {
+      std::cerr << "thread library error: invalid rwlock or rwlock already held for writing" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (rwlock->writer == NO_TID and rwlock->readers == 0) {
+      rwlock->writer = running_thread;
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  enqueue_running(queue_of(rwlock->write_waiters));
+  threads[running_thread].set_flag(FLAG_WRITE_WAIT);
+  forced_switch(SWITCH_PARK); // returns once the lock was handed over for writing
+  return EXIT_SUCCESS;
+}
+
+/* Admits all the readers waiting for rwlock, which no writer holds. */
+void admit_readers(uthread_rwlock *rwlock) {
+  ThreadQueue &readers = queue_of(rwlock->read_waiters);
+  while (!readers.empty()) {
+      rwlock->readers++;
+      unpark(readers.pop_front());
+    }
+}
+
+/* Hands a free rwlock over. After a writer, all waiting readers go first, so readers cannot be starved either;
+   otherwise the next writer does. */
+void grant_rwlock(uthread_rwlock *rwlock, bool after_writer) {
+  ThreadQueue &readers = queue_of(rwlock->read_waiters);
+  ThreadQueue &writers = queue_of(rwlock->write_waiters);
+  if (!writers.empty() and (readers.empty() or !after_writer)) {
+      rwlock->writer = writers.pop_front();
+      unpark(rwlock->writer);
+      return;
+    }
+  admit_readers(rwlock);
+}
+
+
+int uthread_rwlock_unlock(uthread_rwlock *rwlock) {
+  enter_critical_section();
+  if (rwlock == nullptr or (rwlock->writer != running_thread and rwlock->readers == 0)) {
+      std::cerr << "thread library error: rwlock is not held" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (rwlock->writer == running_thread) {
+      rwlock->writer = NO_TID;
+      grant_rwlock(rwlock, true);
+    } else if (--rwlock->readers == 0) {
+      grant_rwlock(rwlock, false);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+// --- channels ---
+
+#define CHAN_BLOCKED 0 /* the operation has to wait */
+#define CHAN_DONE 1
+#define CHAN_CLOSED 2 /* the channel is closed, and drained for a receive */
+#define CHAN_INITIAL_SLOTS 16 /* first buffer of an unbounded channel, doubled when full */
+#define SELECT_INLINE_CASES 4 /* cases a parked select keeps in its own frame */
+
+/* A channel operation a parked thread waits for. It lives in the frame of that thread, which owns the value. */
+struct ChanWaiter {
+  ChanWaiter *next;
+  ChanWaiter *prev;
+  ChanSelect *select;
+  uthread_chan *chan;
+  void *elem; // value to send, or storage to receive into
+  int index; // case of the select
+  bool send;
+};
+
+/* The cases a parked thread waits on. The first one to complete takes all of them off their channels. */
+struct ChanSelect {
+  int tid;
+  int fired; // completed case, -1 while waiting
+  bool closed; // the case completed because its channel was closed
+  ChanWaiter *cases;
+  int count;
+  bool heap_cases; // cases were allocated in the library arena, for selects of more than SELECT_INLINE_CASES
+};
+
+/* Threads parked on one side of a channel, in FIFO order. */
+class WaiterList {
+ private:
+  ChanWaiter *head = nullptr;
+  ChanWaiter *tail = nullptr;
+
+ public:
+  bool empty() const { return head == nullptr; }
+
+  ChanWaiter *front() const { return head; }
+
+  void push_back(ChanWaiter *waiter) {
+    waiter->next = nullptr;
+    waiter->prev = tail;
+    if (tail == nullptr) {
+        head = waiter;
+      } else {
+        tail->next = waiter;
+      }
+    tail = waiter;
+  }
+
+  void remove(ChanWaiter *waiter) {
+    if (waiter->prev == nullptr) {
+        head = waiter->next;
+      } else {
+        waiter->prev->next = waiter->next;
+      }
+    if (waiter->next == nullptr) {
+        tail = waiter->prev;
+      } else {
+        waiter->next->prev = waiter->prev;
+      }
+  }
+};
+
+/* A waiting receiver means the buffer is empty and a waiting sender that it is full, so a message goes straight from
+   the frame of the sender to the frame of the receiver whenever one of them waits. */
+struct uthread_chan {
+  size_t elem_size;
+  int capacity; // UTHREAD_CHAN_UNBOUNDED for no limit
+  uthread_chan_move_fn move; // nullptr for values moved by copying their bytes
+  uthread_chan_destroy_fn destroy;
+  char *buffer; // ring of slots elements
+  size_t slots;
+  size_t head; // slot of the oldest element
+  size_t count;
+  bool closed;
+  WaiterList senders;
+  WaiterList receivers;
+};
+
+unsigned int select_rotation = 0;
+
+void move_elem(uthread_chan *chan, void *dst, void *src) {
+  if (chan->move == nullptr) {
+      memcpy(dst, src, chan->elem_size);
+    } else {
+      chan->move(dst, src);
+    }
+}
+
+void destroy_elem(uthread_chan *chan, void *elem) {
+  if (chan->destroy != nullptr) {
+      chan->destroy(elem);
+    }
+}
+
+char *chan_slot(uthread_chan *chan, size_t i) {
+  return chan->buffer + ((chan->head + i) % chan->slots) * chan->elem_size;
+}
+
+char *alloc_chan_buffer(size_t slots, size_t elem_size) {
+  return (char *) pool_alloc(slots * elem_size);
+}
+
+/* Doubles the buffer of a full unbounded channel. */
+void grow_chan_buffer(uthread_chan *chan) {
+  size_t slots = chan->slots == 0 ? CHAN_INITIAL_SLOTS : chan->slots * 2;
+  char *buffer = alloc_chan_buffer(slots, chan->elem_size);
+  for (size_t i = 0; i < chan->count; i++) {
+      move_elem(chan, buffer + i * chan->elem_size, chan_slot(chan, i));
+      destroy_elem(chan, chan_slot(chan, i));
+    }
+  pool_free(chan->buffer);
+  chan->buffer = buffer;
+  chan->slots = slots;
+  chan->head = 0;
+}
+
+void buffer_push(uthread_chan *chan, void *elem) {
+  if (chan->count == chan->slots) {
+      grow_chan_buffer(chan);
+    }
+  move_elem(chan, chan_slot(chan, chan->count), elem);
+  chan->count++;
+}
+
+void buffer_pop(uthread_chan *chan, void *elem) {
+  char *oldest = chan_slot(chan, 0);
+  move_elem(chan, elem, oldest);
+  destroy_elem(chan, oldest);
+  chan->head = (chan->head + 1) % chan->slots;
+  chan->count--;
+}
+
+WaiterList &waiters_of(ChanWaiter &waiter) {
+  return waiter.send ? waiter.chan->senders : waiter.chan->receivers;
+}
+
+/* Takes all the cases of a select off their channels. */
+void cancel_select(ChanSelect *select) {
+  for (int i = 0; i < select->count; i++) {
+      waiters_of(select->cases[i]).remove(&select->cases[i]);
+    }
+  if (select->heap_cases) {
+      pool_free(select->cases);
+    }
+}
+
+/* Completes the select of a parked thread with the case of waiter, and wakes the thread. */
+void complete_waiter(ChanWaiter *waiter, bool closed) {
+  ChanSelect *select = waiter->select;
+  select->fired = waiter->index;
+  select->closed = closed;
+  for (int i = 0; i < select->count; i++) {
+      waiters_of(select->cases[i]).remove(&select->cases[i]);
+    }
+  unpark(select->tid);
+}
+
+int try_send(uthread_chan *chan, void *elem) {
+  if (chan->closed) {
+      return CHAN_CLOSED;
+    }
+  if (!chan->receivers.empty()) {
+      ChanWaiter *receiver = chan->receivers.front();
+      move_elem(chan, receiver->elem, elem);
+      complete_waiter(receiver, false);
+      return CHAN_DONE;
+    }
+  if (chan->capacity == UTHREAD_CHAN_UNBOUNDED or chan->count < (size_t) chan->capacity) {
+      buffer_push(chan, elem);
+      return CHAN_DONE;
+    }
+  return CHAN_BLOCKED;
+}
+
+int try_recv(uthread_chan *chan, void *elem) {
+  if (chan->count > 0) {
+      buffer_pop(chan, elem);
+      if (!chan->senders.empty()) { // the buffer was full, the first waiting sender takes the freed slot
+          ChanWaiter *sender = chan->senders.front();
+          buffer_push(chan, sender->elem);
+          complete_waiter(sender, false);
+        }
+      return CHAN_DONE;
+    }
+  if (!chan->senders.empty()) { // unbuffered channel
+      ChanWaiter *sender = chan->senders.front();
+      move_elem(chan, elem, sender->elem);
+      complete_waiter(sender, false);
+      return CHAN_DONE;
+    }
+  return chan->closed ? CHAN_CLOSED : CHAN_BLOCKED;
+}
+
+/* Runs the first case that can complete, starting from a rotating position so that no case starves the others, or
+   parks the running thread on all of them. Called in the critical section, which it leaves. */
+int select_cases(uthread_chan_case *cases, int count, bool block) {
+  int start = (int) (select_rotation++ % (unsigned int) count);
+  for (int n = 0; n < count; n++) {
+      int i = (start + n) % count;
+      bool send = cases[i].op == UTHREAD_CHAN_SEND;
+      int result = send ? try_send(cases[i].chan, cases[i].elem) : try_recv(cases[i].chan, cases[i].elem);
+      if (result == CHAN_BLOCKED) {
+          continue;
+        }
+      leave_critical_section();
+      if (result == CHAN_CLOSED and send) {
+          std::cerr << "thread library error: send on a closed channel" << std::endl;
+          return -1;
+        }
+      cases[i].closed = result == CHAN_CLOSED;
+      return i;
+    }
+  if (!block) {
+      leave_critical_section();
+      return count;
+    }
+
+  ChanWaiter inline_cases[SELECT_INLINE_CASES];
+  ChanSelect select = {running_thread, -1, false, inline_cases, count, count > SELECT_INLINE_CASES};
+  if (select.heap_cases) {
+      select.cases = (ChanWaiter *) pool_alloc(count * sizeof(ChanWaiter));
+    }
+  for (int i = 0; i < count; i++) {
+      ChanWaiter &waiter = select.cases[i];
+      waiter.select = &select;
+      waiter.chan = cases[i].chan;
+      waiter.elem = cases[i].elem;
+      waiter.index = i;
+      waiter.send = cases[i].op == UTHREAD_CHAN_SEND;
+      waiters_of(waiter).push_back(&waiter);
+    }
+  threads[running_thread].set_select(&select);
+  threads[running_thread].set_flag(FLAG_SELECTING);
+  forced_switch(SWITCH_PARK); // returns once a case completed, or its channel was closed
+
+  enter_critical_section();
+  if (select.heap_cases) {
+      pool_free(select.cases);
+    }
+  leave_critical_section();
+  if (select.closed and cases[select.fired].op == UTHREAD_CHAN_SEND) {
+      std::cerr << "thread library error: send on a closed channel" << std::endl;
+      return -1;
+    }
+  cases[select.fired].closed = select.closed;
+  return select.fired;
+}
+
+
+uthread_chan *uthread_chan_create(size_t elem_size, int capacity) {
+  return uthread_chan_create_typed(elem_size, capacity, nullptr, nullptr);
+}
+
+
+uthread_chan *uthread_chan_create_typed(size_t elem_size, int capacity, uthread_chan_move_fn move,
+                                        uthread_chan_destroy_fn destroy) {
+  if (elem_size == 0 or capacity < UTHREAD_CHAN_UNBOUNDED) {
+      std::cerr << "thread library error: invalid channel element size or capacity" << std::endl;
+      return nullptr;
+    }
+  enter_critical_section();
+  uthread_chan *chan = pool_new<uthread_chan>();
+  chan->elem_size = elem_size;
+  chan->capacity = capacity;
+  chan->move = move;
+  chan->destroy = destroy;
+  if (capacity > 0) {
+      chan->buffer = alloc_chan_buffer(capacity, elem_size);
+      chan->slots = capacity;
+    }
+  leave_critical_section();
+  return chan;
+}
+
+
+int uthread_chan_destroy(uthread_chan *chan) {
+  enter_critical_section();
+  if (chan == nullptr or !chan->senders.empty() or !chan->receivers.empty()) {
+      std::cerr << "thread library error: invalid channel or threads still wait on it" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  for (size_t i = 0; i < chan->count; i++) {
+      destroy_elem(chan, chan_slot(chan, i));
+    }
+  pool_free(chan->buffer);
+  pool_delete(chan);
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_chan_send(uthread_chan *chan, void *elem) {
+  uthread_chan_case send_case = {chan, UTHREAD_CHAN_SEND, elem, 0};
+  return uthread_chan_select(&send_case, 1, 1) == 0 ? EXIT_SUCCESS : -1;
+}
+
+
+int uthread_chan_recv(uthread_chan *chan, void *elem) {
+  uthread_chan_case recv_case = {chan, UTHREAD_CHAN_RECV, elem, 0};
+  int result = uthread_chan_select(&recv_case, 1, 1);
+  return result == 0 ? recv_case.closed : -1;
+}
+
+
+int uthread_chan_close(uthread_chan *chan) {
+  enter_critical_section();
+  if (chan == nullptr or chan->closed) {
+      std::cerr << "thread library error: invalid channel or channel already closed" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  chan->closed = true;
+  while (!chan->receivers.empty()) {
+      complete_waiter(chan->receivers.front(), true);
+    }
+  while (!chan->senders.empty()) {
+      complete_waiter(chan->senders.front(), true);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
+}
+
+
+int uthread_chan_select(uthread_chan_case *cases, int count, int block) {
+  enter_critical_section();
+  bool valid = cases != nullptr and count > 0;
+  for (int i = 0; valid and i < count; i++) {
+      valid = cases[i].chan != nullptr and cases[i].elem != nullptr
+              and (cases[i].op == UTHREAD_CHAN_SEND or cases[i].op == UTHREAD_CHAN_RECV);
+      cases[i].closed = 0;
+    }
+  if (!valid) {
+      std::cerr << "thread library error: invalid select cases" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  return select_cases(cases, count, block != 0);
+}
+
+
+// --- I/O reactor ---
+
+#define IO_EVENTS 64 /* events taken from epoll at a time */
+
+/* Threads parked on a file descriptor. Descriptors are registered with epoll once, edge-triggered for both
+   directions, so parking costs no system call. */
+struct IoWaiters {
+  ThreadQueue readers;
+  ThreadQueue writers;
+  bool pollable; // false for descriptors epoll cannot wait on, such as regular files
+};
+
+int epoll_fd = -1;
+PoolVector<IoWaiters *> io_fds; // indexed by file descriptor
+int io_parked = 0; // threads parked on descriptors, the reactor is only polled while there are some
+
+/* Returns the waiters of fd, registering it in non-blocking mode on first use, or nullptr if fd cannot be waited on
+   and is used as it is. */
+IoWaiters *io_waiters_of(int fd) {
+  if (fd < 0) {
+      return nullptr;
+    }
+  if ((size_t) fd >= io_fds.size()) {
+      io_fds.resize(fd + 1, nullptr);
+    }
+  if (io_fds[fd] == nullptr) {
+      if (epoll_fd < 0) {
+          epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+          if (epoll_fd < 0) {
+              std::cerr << "system error: epoll creation fails" << std::endl;
+              exit(1);
+            }
+        }
+      epoll_event event = {};
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.fd = fd;
+      bool pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+      if (!pollable and errno != EPERM) { // not open, nothing to remember
+          return nullptr;
+        }
+      if (pollable) {
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+      io_fds[fd] = pool_new<IoWaiters>();
+      io_fds[fd]->pollable = pollable;
+    }
+  return io_fds[fd]->pollable ? io_fds[fd] : nullptr;
+}
+
+void wake_io_waiters(ThreadQueue &queue) {
+  while (!queue.empty()) {
+      io_parked--;
+      unpark(queue.pop_front());
+    }
+}
+
+/* Wakes the threads parked on descriptors that became ready, without waiting. Woken threads retry their operation,
+   and park again if another thread took the data or the room first. */
+void poll_io() {
+  if (io_parked == 0) {
+      return;
+    }
+  epoll_event events[IO_EVENTS];
+  int count = epoll_wait(epoll_fd, events, IO_EVENTS, 0);
+  for (int i = 0; i < count; i++) {
+      IoWaiters *waiters = io_fds[events[i].data.fd];
+      if (waiters == nullptr) { // closed since the event
+          continue;
+        }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          wake_io_waiters(waiters->readers);
+        }
+      if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+          wake_io_waiters(waiters->writers);
+        }
+    }
+}
+
+/* Queues the running thread to be woken once fd may be ready in the direction of queue. */
+void wait_on_io(ThreadQueue &queue) {
+  enqueue_running(queue);
+  threads[running_thread].set_flag(FLAG_IO);
+  io_parked++;
+  note_new_wait();
+}
+
+/* Parks the running thread until fd may be ready in the direction of queue. */
+void park_on_io(ThreadQueue &queue) {
+  wait_on_io(queue);
+  forced_switch(SWITCH_PARK);
+}
+
+/* Runs a non-blocking operation until it does not fail with EINTR. Returns whether it is done, rather than failed with
+   EAGAIN and waiting for the descriptor; errno is left as the operation set it. */
+template <typename Operation>
+bool attempt_io(Operation operation, ssize_t &result) {
+  do {
+      result = operation();
+    } while (result < 0 and errno == EINTR);
+  return result >= 0 or (errno != EAGAIN and errno != EWOULDBLOCK);
+}
+
+/* Runs a non-blocking operation on fd until it does not fail with EAGAIN, parking the running thread between the
+   attempts. Each attempt runs in the critical section, so a readiness edge cannot be taken by the reactor between a
+   failed attempt and the parking. */
+template <typename Operation>
+ssize_t retry_io(int fd, bool write, Operation operation) {
+  enter_critical_section();
+  IoWaiters *waiters = io_waiters_of(fd);
+  if (waiters == nullptr) {
+      leave_critical_section();
+      return operation();
+    }
+  ssize_t result;
+  while (!attempt_io(operation, result)) {
+      park_on_io(write ? waiters->writers : waiters->readers);
+      enter_critical_section();
+    }
+  int saved_errno = errno;
+  leave_critical_section();
+  errno = saved_errno;
+  return result;
+}
+
+
+ssize_t uthread_read(int fd, void *buf, size_t count) {
+  return retry_io(fd, false, [=]() { return read(fd, buf, count); });
+}
+
+
+ssize_t uthread_write(int fd, const void *buf, size_t count) {
+  return retry_io(fd, true, [=]() { return write(fd, buf, count); });
+}
+
+
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  return (int) retry_io(fd, false, [=]() { return (ssize_t) accept(fd, addr, addrlen); });
+}
+
+
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen) {
+  enter_critical_section();
+  IoWaiters *waiters = io_waiters_of(fd);
+  int result = connect(fd, addr, addrlen);
+  // The socket turns writable once the connection is established or failed. Connecting again tells which.
+  while (result < 0 and waiters != nullptr and (errno == EINPROGRESS or errno == EALREADY or errno == EINTR)) {
+      if (errno != EINTR) {
+          park_on_io(waiters->writers);
+          enter_critical_section();
+        }
+      result = connect(fd, addr, addrlen);
+      if (result < 0 and errno == EISCONN) {
+          result = 0;
+        }
+    }
+  int saved_errno = errno;
+  leave_critical_section();
+  errno = saved_errno;
+  return result;
+}
+
+
+int uthread_close(int fd) {
+  enter_critical_section();
+  if (fd >= 0 and (size_t) fd < io_fds.size() and io_fds[fd] != nullptr) {
+      wake_io_waiters(io_fds[fd]->readers);
+      wake_io_waiters(io_fds[fd]->writers);
+      pool_delete(io_fds[fd]);
+      io_fds[fd] = nullptr;
+    }
+  int result = close(fd);
+  int saved_errno = errno;
+  leave_critical_section();
+  errno = saved_errno;
+  return result;
+}
+
+
+// --- join ---
+
+JoinState *join_state_of(int tid) {
+  if (threads[tid].get_join() == nullptr) {
+      threads[tid].set_join(pool_new<JoinState>(JoinState{nullptr, nullptr, nullptr, nullptr, nullptr}));
+    }
+  return threads[tid].get_join();
+}
+
+/* Hands the exit value of a finished thread straight to the threads joining it. Returns whether the thread has to be
+   kept until joined, being joinable and not joined yet. */
+bool deliver_exit_value(int tid) {
+  JoinState *join = threads[tid].get_join();
+  if (join == nullptr) {
+      return false;
+    }
+  bool joined = join->joiners != nullptr and !join->joiners->empty();
+  while (join->joiners != nullptr and !join->joiners->empty()) {
+      int joiner = join->joiners->pop_front();
+      void **join_into = threads[joiner].get_join()->join_into;
+      if (join_into != nullptr) {
+          *join_into = join->value;
+        }
+      unpark(joiner);
+    }
+  return !joined and threads[tid].has_flag(FLAG_JOINABLE);
+}
+
+
+void uthread_exit(void *value) {
+  if (running_thread != 0) {
+      run_specific_destructors();
+    }
+  enter_critical_section();
+  if (running_thread == 0) {
+      close_program();
+    }
+  if (threads[running_thread].get_join() != nullptr) {
+      threads[running_thread].get_join()->value = value;
+    }
+  scheduler.clear_deadline(running_thread);
+  forced_switch(SWITCH_TERMINATE);
+}
+
 
-  void set_state(int);
+int uthread_join(int tid, void **value) {
+  enter_critical_section();
+  if (tid < 0 or tid >= threads.capacity() or !threads[tid].has_flag(FLAG_USED)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (tid == 0 or tid == running_thread) {
+      std::cerr << "thread library error: a thread cannot join itself or the main thread" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  JoinState *join = join_state_of(tid);
+  if (threads[tid].has_flag(FLAG_EXITED)) {
+      if (value != nullptr) {
+          *value = join->value;
+        }
+      release_tid(tid);
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  if (join->joiners == nullptr) {
+      join->joiners = pool_new<ThreadQueue>();
+    }
+  join_state_of(running_thread)->join_into = value;
+  enqueue_running(*join->joiners);
+  forced_switch(SWITCH_PARK); // returns once tid finished, with the value stored
+  return EXIT_SUCCESS;
+}
 
-  char get_stack() const;
-};
 
+// --- tracing ---
 
+#ifdef UTHREADS_TRACE
+const char *const trace_names[] = {"run", "spawn", "block", "park", "resume", "sleep", "wake", "exit"};
 
-// --- Data structures and general functions ---
+/* Writes the events of one worker, oldest first. Each run of a thread becomes a complete event on the track of the
+   worker, the other events are instant events naming the thread. */
+void dump_worker_trace(FILE *file, int worker, const std::vector<TraceEvent> &events, double usecs_per_tick,
+                       uint64_t end_tsc, bool &first) {
+  fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+          first ? "" : ",\n", worker, worker);
+  first = false;
+  int running = NO_TID;
+  uint64_t run_start = 0;
+  for (size_t i = 0; i <= events.size(); i++) {
+      bool last = i == events.size();
+      if ((last or events[i].type == TRACE_RUN) and running != NO_TID) {
+          uint64_t run_end = last ? end_tsc : events[i].tsc;
+          fprintf(file, ",\n{\"name\":\"thread %d\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                  running, worker, (double) (run_start - trace_start_tsc) * usecs_per_tick,
+                  (double) (run_end - run_start) * usecs_per_tick);
+        }
+      if (last) {
+          break;
+        }
+      double ts = (double) (events[i].tsc - trace_start_tsc) * usecs_per_tick;
+      if (events[i].type == TRACE_RUN) {
+          running = events[i].tid;
+          run_start = events[i].tsc;
+          continue;
+        }
+      fprintf(file, ",\n{\"name\":\"%s %d\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"tid\":%d}}",
+              trace_names[events[i].type], events[i].tid, worker, ts, events[i].tid);
+    }
+}
+#endif
 
-std::unordered_map<int, int> ids_map; // key is tid, val is status (used, unused)
-std::unordered_map<int, Thread *> active_threads; // key is tid, val is ptr to thread
-std::set<int> blocked_threads; // set of all tid of blocked threads
-std::unordered_map<int, int> sleeping_threads; // key is tid, val is num of quantums if sleepeing.
-std::list<int> ready_q; // tid
-int running_thread;
 
-void timed_switch(int);
+int uthread_trace_dump(const char *path) {
+#ifdef UTHREADS_TRACE
+  if (path == nullptr) {
+      std::cerr << "thread library error: path cannot be nullptr" << std::endl;
+      return -1;
+    }
+  // The rings are copied inside the critical section and formatted outside, so the workers are held up by a copy,
+  // into vectors sized beforehand so that the copy does not call into malloc.
+  std::vector<std::vector<TraceEvent>> rings(num_workers);
+  for (std::vector<TraceEvent> &ring : rings) {
+      ring.reserve(TRACE_EVENTS);
+    }
+  enter_critical_section();
+  for (int i = 0; i < num_workers; i++) {
+      uint64_t head = workers[i].trace_head;
+      uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+      for (uint64_t event = first; event < head; event++) {
+          rings[i].push_back(workers[i].trace[event & (TRACE_EVENTS - 1)]);
+        }
+    }
+  uint64_t end_tsc = __builtin_ia32_rdtsc();
+  uint64_t end_nsecs = now_nsecs();
+  leave_critical_section();
+  FILE *file = fopen(path, "w");
+  if (file == nullptr) {
+      std::cerr << "thread library error: cannot open the trace file" << std::endl;
+      return -1;
+    }
+  double usecs_per_tick = (double) (end_nsecs - trace_start_nsecs) / NSECS_PER_USEC / (double) (end_tsc - trace_start_tsc);
+  bool first = true;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (int i = 0; i < num_workers; i++) {
+      dump_worker_trace(file, i, rings[i], usecs_per_tick, end_tsc, first);
+    }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0 ? EXIT_SUCCESS : -1;
+#else
+  (void) path;
+  std::cerr << "thread library error: tracing is not compiled in, build with UTHREADS_TRACE defined" << std::endl;
+  return -1;
+#endif
+}
 
-void close_program();
 
-sigjmp_buf env[MAX_THREAD_NUM + 1];
-int total_quantum_num;
-typedef unsigned long address_t;
+// --- tasks ---
 
+/* Task frames are kept as coroutine addresses, so the library also builds before C++20, without tasks. */
+void resume_coroutine(void *address) {
+#ifdef __cpp_impl_coroutine
+  std::coroutine_handle<>::from_address(address).resume();
+#else
+  (void) address;
+#endif
+}
 
-void block_timer_signal() {
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
-  sigprocmask(SIG_BLOCK, &set, nullptr);
+bool coroutine_done(void *address) {
+#ifdef __cpp_impl_coroutine
+  return std::coroutine_handle<>::from_address(address).done();
+#else
+  (void) address;
+  return true;
+#endif
 }
 
-void unblock_timer_signal() {
-  sigset_t set;
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
-  sigprocmask(SIG_UNBLOCK, &set, nullptr);
+void destroy_coroutine(void *address) {
+#ifdef __cpp_impl_coroutine
+  std::coroutine_handle<>::from_address(address).destroy();
+#else
+  (void) address;
+#endif
 }
 
+/* A channel operation a task waits for, kept in the frame of its awaiter as a thread keeps it on its stack. */
+struct TaskChanWait {
+  ChanSelect select;
+  ChanWaiter waiter;
+};
+
+static_assert(sizeof(TaskChanWait) <= UTHREAD_TASK_WAIT_BYTES, "UTHREAD_TASK_WAIT_BYTES is too small");
 
-void awake_thread(int tid) {
-  if ((active_threads.find(tid) == active_threads.end()) or (sleeping_threads.find(tid) == sleeping_threads.end())) {
+/* Runs the task tid on the stack of the scheduling loop until it suspends at a co_await or returns. A task is not
+   preempted, its quantum ends where it suspends: an awaiter that parks it returns here still in the critical section,
+   through suspend_task. Called in the critical section, which is kept. */
+void run_task(int tid) {
+  preemption_pending = 0;
+  reschedule_pending = 0;
+  scheduler.renew_quantum();
+  start_running(tid);
+  task_running = true;
+  leave_critical_section();
+  resume_coroutine(*threads[tid].get_context());
+  if (!task_running) { // parked
       return;
     }
-  if (blocked_threads.find(tid) == blocked_threads.end()) {
-      active_threads[tid]->set_state(READY);
-      ready_q.push_back(tid);
+  enter_critical_section();
+  if (!coroutine_done(threads[tid].get_frame())) {
+      std::cerr << "thread library error: a task can only co_await tasks and the awaitables of uthreads" << std::endl;
+      exit(1);
     }
-  sleeping_threads.erase(tid);
+  void *frame = threads[tid].get_frame();
+  switch_out(SWITCH_TERMINATE, 0);
+  running_thread = NO_TID;
+  task_running = false;
+  destroy_coroutine(frame); // suspended at its final point, its locals are already destroyed
 }
 
-
-// --- thread class implementation ---
-
-/* A translation is required when using an address of a variable.
-   Use this as a black box in your code. */
-address_t translate_address(address_t addr) {
-  address_t ret;
-  asm volatile("xor    %%fs:0x30,%0\n"
-               "rol    $0x11,%0\n"
-  : "=g" (ret)
-  : "0" (addr));
-  return ret;
+/* Switches the running task out for reason, as forced_switch does for a thread, except that the task suspends by
+   returning to run_task, and is resumed at handle. Called in the critical section, which is kept. */
+void suspend_task(void *handle, int reason, long amount = 0) {
+  *threads[running_thread].get_context() = handle;
+  switch_out(reason, amount);
+  running_thread = NO_TID;
+  task_running = false;
 }
 
-Thread::Thread(int tid, thread_entry_point entryPoint) {
-  this->tid = tid;
-  this->state = READY;
-  this->entryPoint = entryPoint;
-  this->quantums_counter = 0;
-  sigsetjmp(env[tid], 1);
-  address_t sp = (address_t) this->stack + STACK_SIZE - sizeof(address_t);
-  address_t pc = (address_t) entryPoint;
-  (env[tid]->__jmpbuf)[JB_SP] = translate_address(sp);
-  (env[tid]->__jmpbuf)[JB_PC] = translate_address(pc);
-  sigemptyset(&env[tid]->__saved_mask);
+/* Finishes the running task instead of parking it if another worker terminated it while it ran. Its frame still holds
+   locals, so it is destroyed outside the critical section before the task is released, the task counting as running
+   until then. Called in the critical section, which is kept. */
+bool finish_if_cancelled() {
+  int tid = running_thread;
+  if (!threads[tid].has_flag(FLAG_CANCELLED)) {
+      return false;
+    }
+  leave_critical_section();
+  destroy_coroutine(threads[tid].get_frame()); // while its arena is still there, for the destructors
+  enter_critical_section();
+  switch_out(SWITCH_TERMINATE, 0);
+  running_thread = NO_TID;
+  task_running = false;
+  return true;
 }
 
-Thread::~Thread() {
-}
 
-Thread::Thread(const Thread &other) {
-  this->tid = other.tid;
-  this->state = other.state;
-  this->quantums_counter = other.quantums_counter;
-  for (int i = 0; i < STACK_SIZE; i++) {
-      this->stack[i] = other.stack[i];
+int uthread_task_spawn(void *frame) {
+#ifdef __cpp_impl_coroutine
+  if (frame == nullptr) {
+      std::cerr << "thread library error: task cannot be nullptr" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  int tid = allocate_tid();
+  if (tid == NO_TID) {
+      std::cerr << "thread library error: you reached the max number of threads" << std::endl;
+      leave_critical_section();
+      return -1;
     }
-  this->entryPoint = other.entryPoint;
+  threads[tid].init(tid, nullptr, nullptr, 0);
+  threads[tid].set_flag(FLAG_TASK);
+  threads[tid].set_frame(frame);
+  *threads[tid].get_context() = frame;
+  scheduler.place_new(tid);
+  TRACE(TRACE_SPAWN, tid);
+  make_ready(tid);
+  leave_critical_section();
+  return tid;
+#else
+  (void) frame;
+  std::cerr << "thread library error: tasks need the library built as C++20" << std::endl;
+  return -1;
+#endif
 }
 
-Thread &Thread::operator=(const Thread &other) {
-  if (this != &other) {
-      this->tid = other.tid;
-      this->state = other.state;
-      this->quantums_counter = other.quantums_counter;
-      for (int i = 0; i < STACK_SIZE; i++) {
-          this->stack[i] = other.stack[i];
-        }
-      this->entryPoint = other.entryPoint;
+
+int uthread_task_yield(void *handle) {
+  enter_critical_section();
+  if (!scheduler.can_yield(running_thread)) {
+      leave_critical_section();
+      return EXIT_SUCCESS;
+    }
+  if (!finish_if_cancelled()) {
+      suspend_task(handle, SWITCH_YIELD);
     }
-  return *this;
+  return UTHREAD_TASK_PARKED;
 }
 
-/*getters and setters of Thread*/
 
-int Thread::get_thread_quantums() const {
-  return this->quantums_counter;
+int uthread_task_sleep_usecs(void *handle, int usecs) {
+  if (usecs <= 0) {
+      std::cerr << "thread library error: usecs must be positive" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  if (!finish_if_cancelled()) {
+      suspend_task(handle, SWITCH_SLEEP_USECS, usecs);
+    }
+  return UTHREAD_TASK_PARKED;
 }
 
-void Thread::increment_quantums() {
-  this->quantums_counter++;
-}
 
-int Thread::get_tid() const {
-  return this->tid;
+int uthread_task_chan_op(void *handle, uthread_chan_case *op, void *wait) {
+  if (op == nullptr or op->chan == nullptr or op->elem == nullptr
+      or (op->op != UTHREAD_CHAN_SEND and op->op != UTHREAD_CHAN_RECV)) {
+      std::cerr << "thread library error: invalid channel operation" << std::endl;
+      return -1;
+    }
+  bool send = op->op == UTHREAD_CHAN_SEND;
+  enter_critical_section();
+  int result = send ? try_send(op->chan, op->elem) : try_recv(op->chan, op->elem);
+  if (result != CHAN_BLOCKED) {
+      leave_critical_section();
+      if (result == CHAN_CLOSED and send) {
+          std::cerr << "thread library error: send on a closed channel" << std::endl;
+          return -1;
+        }
+      op->closed = result == CHAN_CLOSED;
+      return EXIT_SUCCESS;
+    }
+  if (finish_if_cancelled()) {
+      return UTHREAD_TASK_PARKED;
+    }
+  auto *record = new (wait) TaskChanWait();
+  record->select = {running_thread, -1, false, &record->waiter, 1, false};
+  record->waiter.select = &record->select;
+  record->waiter.chan = op->chan;
+  record->waiter.elem = op->elem;
+  record->waiter.index = 0;
+  record->waiter.send = send;
+  waiters_of(record->waiter).push_back(&record->waiter);
+  threads[running_thread].set_select(&record->select);
+  threads[running_thread].set_flag(FLAG_SELECTING);
+  suspend_task(handle, SWITCH_PARK);
+  return UTHREAD_TASK_PARKED;
 }
 
-int Thread::get_state() const {
-  return this->state;
-}
 
-void Thread::set_state(int new_state) {
-  this->state = new_state;
+int uthread_task_chan_result(void *wait, uthread_chan_case *op) {
+  ChanSelect &select = static_cast<TaskChanWait *>(wait)->select;
+  if (select.closed and op->op == UTHREAD_CHAN_SEND) {
+      std::cerr << "thread library error: send on a closed channel" << std::endl;
+      return -1;
+    }
+  op->closed = select.closed;
+  return EXIT_SUCCESS;
 }
 
 
+ssize_t uthread_task_io(void *handle, int fd, int write, uthread_task_io_fn op, void *context, int *parked) {
+  *parked = 0;
+  enter_critical_section();
+  IoWaiters *waiters = io_waiters_of(fd);
+  if (waiters == nullptr) {
+      leave_critical_section();
+      return op(context);
+    }
+  ssize_t result;
+  if (attempt_io([=]() { return op(context); }, result)) {
+      int saved_errno = errno;
+      leave_critical_section();
+      errno = saved_errno;
+      return result;
+    }
+  *parked = 1;
+  if (!finish_if_cancelled()) {
+      wait_on_io(write ? waiters->writers : waiters->readers);
+      suspend_task(handle, SWITCH_PARK);
+    }
+  return -1;
+}
 
 
-// --- scheduler implementation ---
-class Scheduler {
- private:
-  int quantum_usecs;
-  struct sigaction sa = {0};
-  struct itimerval timer;
-
- public:
-  Scheduler() {}
+// --- thread-specific data ---
 
-  Scheduler(int quantum_usecs) {
-    this->quantum_usecs = quantum_usecs;
-  }
+/* A key of thread-specific data. The values of a key live in the local data of the threads, at its index. */
+struct SpecificKey {
+  bool used;
+  uthread_key_destructor destructor;
+};
 
-  const itimerval *get_timer() { return &this->timer; }
+SpecificKey specific_keys[UTHREAD_KEYS_MAX]; // fixed, so that a key is read without the critical section
 
-  void reset_timer() {
-    if (setitimer(ITIMER_VIRTUAL, &timer, nullptr)) {
-        std::cerr << "system error: timer error" << std::endl;
-        exit(1);
-      }
-  }
+/* Runs the destructors of the non-null values of the running thread, which ends itself, in its own context. A
+   destructor may set values again, so this is repeated up to UTHREAD_DESTRUCTOR_ITERATIONS times. */
+void run_specific_destructors() {
+  LocalData *local = threads[running_thread].get_local();
+  PoolVector<void *> *values = local != nullptr ? &local->specific : nullptr;
+  for (int iteration = 0; values != nullptr and iteration < UTHREAD_DESTRUCTOR_ITERATIONS; iteration++) {
+      bool ran = false;
+      for (size_t key = 0; key < values->size(); key++) {
+          void *value = (*values)[key];
+          uthread_key_destructor destructor = specific_keys[key].destructor;
+          if (value != nullptr and destructor != nullptr) {
+              (*values)[key] = nullptr;
+              destructor(value);
+              ran = true;
+            }
+        }
+      if (!ran) {
+          break;
+        }
+    }
+}
 
-  void set_timer() {
-    sa.sa_handler = &timed_switch;
-    if (sigaction(SIGVTALRM, &sa, nullptr) < 0) {
-        std::cerr << "system error: timer error" << std::endl;
-        exit(1);
-      }
-    timer.it_value.tv_sec = this->quantum_usecs / 1000000;        // first time interval, seconds part
-    timer.it_value.tv_usec = this->quantum_usecs % 1000000;        // first time interval, microseconds part
-    timer.it_interval.tv_sec = this->quantum_usecs / 1000000;     // following time intervals, seconds part
-    timer.it_interval.tv_usec = this->quantum_usecs % 1000000;    // following time intervals, microseconds part
-    // Start a virtual timer. It counts down whenever this process is executing.
-    if (setitimer(ITIMER_VIRTUAL, &timer, NULL)) {
-        std::cerr << "system error: timer error" << std::endl;
-        exit(1);
-      }
-  }
-};
 
+int uthread_key_create(uthread_key *key, uthread_key_destructor destructor) {
+  if (key == nullptr) {
+      std::cerr << "thread library error: key cannot be nullptr" << std::endl;
+      return -1;
+    }
+  enter_critical_section();
+  for (int index = 0; index < UTHREAD_KEYS_MAX; index++) {
+      if (!specific_keys[index].used) {
+          specific_keys[index] = {true, destructor};
+          *key = index;
+          leave_critical_section();
+          return EXIT_SUCCESS;
+        }
+    }
+  std::cerr << "thread library error: you reached the max number of keys" << std::endl;
+  leave_critical_section();
+  return -1;
+}
 
-Scheduler scheduler;
 
-void reduce_sleep_quantums() {
-  for (auto sleep_t = sleeping_threads.begin(); sleep_t != sleeping_threads.end(); sleep_t++) {
-      sleep_t->second--;
-      if (sleep_t->second == 0) {
-          awake_thread(sleep_t->first);
+int uthread_key_delete(uthread_key key) {
+  enter_critical_section();
+  if (key < 0 or key >= UTHREAD_KEYS_MAX or !specific_keys[key].used) {
+      std::cerr << "thread library error: key is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  specific_keys[key] = {false, nullptr};
+  for (int tid = 0; tid < threads.capacity(); tid++) { // so that a key created later starts out null everywhere
+      LocalData *local = threads[tid].has_flag(FLAG_USED) ? threads[tid].get_local() : nullptr;
+      if (local != nullptr and (size_t) key < local->specific.size()) {
+          local->specific[key] = nullptr;
         }
     }
+  leave_critical_section();
+  return EXIT_SUCCESS;
 }
 
-void prepare_next_running() {
-  running_thread = ready_q.front();
-  ready_q.pop_front();
-  active_threads[running_thread]->set_state(RUNNING);
-  active_threads[running_thread]->increment_quantums();
-  siglongjmp(env[running_thread], 1);
+
+void *uthread_getspecific(uthread_key key) {
+  LocalData *local = threads[running_thread].get_local();
+  if (local == nullptr or key < 0 or (size_t) key >= local->specific.size()) {
+      return nullptr;
+    }
+  return local->specific[key];
 }
 
-void reset_timer() {
-  if (setitimer(ITIMER_VIRTUAL, scheduler.get_timer(), nullptr)) {
-      std::cerr << "system error: timer error" << std::endl;
-      exit(1);
+
+int uthread_setspecific(uthread_key key, const void *value) {
+  LocalData *local = threads[running_thread].get_local();
+  if (local != nullptr and key >= 0 and (size_t) key < local->specific.size()) {
+      local->specific[key] = const_cast<void *>(value);
+      return EXIT_SUCCESS;
     }
+  enter_critical_section(); // the values grow, which uthread_key_delete must not see half done
+  if (key < 0 or key >= UTHREAD_KEYS_MAX or !specific_keys[key].used) {
+      std::cerr << "thread library error: key is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  local = local_data_of(running_thread);
+  local->specific.resize(key + 1, nullptr);
+  local->specific[key] = const_cast<void *>(value);
+  leave_critical_section();
+  return EXIT_SUCCESS;
 }
 
-void forced_switch(int to_sleep = -1, bool to_block = false, bool to_terminate = false) {
-  block_timer_signal();
-  reduce_sleep_quantums();
-  total_quantum_num++;
-  int prev_thread = running_thread;
-  int ret_val = sigsetjmp(env[running_thread], 1);
-  if (ret_val == 0) {
-      if (to_block) {
-          active_threads[prev_thread]->set_state(BLOCKED);
-          blocked_threads.insert(prev_thread);
-        } else if (to_sleep >= 0) {
-          active_threads[prev_thread]->set_state(BLOCKED);
-          sleeping_threads[prev_thread] = to_sleep;
-
-        } else if (to_terminate) {
-          delete active_threads[prev_thread];
-          active_threads.erase(prev_thread);
-          ids_map[prev_thread] = UNUSED;
-        } else {
-          active_threads[prev_thread]->set_state(READY);
-          ready_q.push_back(prev_thread);
+
+// --- thread arenas ---
+
+void *uthread_alloc(size_t size) {
+  int size_class = size_class_of(size);
+  LocalData *local = threads[running_thread].get_local();
+  if (local != nullptr and size_class != ARENA_LARGE) { // touches only the arena of the thread, so no lock is needed
+      void *block = arena_take(local->arena, size_class);
+      if (block != nullptr) {
+          return block;
         }
-      prepare_next_running();
     }
-  reset_timer();
-  unblock_timer_signal();
+  enter_critical_section();
+  void *block = arena_grow(local_data_of(running_thread)->arena, running_thread, size);
+  leave_critical_section();
+  return block;
 }
 
 
-void timed_switch(int sig) {
-  block_timer_signal();
-  total_quantum_num++;
-  reduce_sleep_quantums();
-  int prev_thread = running_thread;
-  int ret_val = sigsetjmp(env[running_thread], 1);
-  if (ret_val == 0) {
-      active_threads[prev_thread]->set_state(READY);
-      ready_q.push_back(prev_thread);
-      prepare_next_running();
+void uthread_free(void *block) {
+  if (block == nullptr) {
+      return;
     }
-  reset_timer();
-  unblock_timer_signal();
+  ArenaChunk *chunk = chunk_of(block);
+  if (chunk->owner != running_thread and (chunk->owner == NO_TID or !threads[chunk->owner].has_flag(FLAG_DYING))) {
+      std::cerr << "thread library error: a block can only be freed by the thread that allocated it" << std::endl;
+      return;
+    }
+  LocalData *local = threads[chunk->owner].get_local(); // of a dying task, for the destructors of its frame
+  if (chunk->size_class != ARENA_LARGE) {
+      arena_give(local->arena, block, chunk->size_class);
+      return;
+    }
+  enter_critical_section();
+  arena_give_large(local->arena, chunk);
+  leave_critical_section();
 }
 
 
-// --- uthread library implementation ---
+// --- thread groups ---
 
-int uthread_init(int quantum_usecs) {
+/* A group of threads. Groups form a tree under the root group, which holds the threads of no other group. Sibling
+   groups with runnable threads share the CPU in proportion to their weights, by their virtual runtimes, and a group
+   may be capped by a quota of CPU time per period, which also caps its descendants. Only the groups below the root
+   are accounted for, so a process without groups pays nothing. */
+struct Group {
+  bool used;
+  int parent;
+  int weight;
+  int members; // threads in the group itself
+  int children;
+  int runnable; // READY and RUNNING threads of the group and of its descendants
+  uint64_t vruntime; // CPU time of the group and of its descendants, in nanoseconds weighted by its weight
+  uint64_t quota; // nanoseconds of CPU time per period, 0 if the group is not capped
+  uint64_t period;
+  uint64_t period_start;
+  uint64_t period_used; // CPU time of the group and of its descendants in the current period
+};
 
-  if (quantum_usecs <= 0) {
-      std::cerr << "thread library error: invalid quantum_usecs" << std::endl;
-      return -1;
-    }
-  //initialize ids_map
-  for (int i = 1; i < MAX_THREAD_NUM; i++) {
-      ids_map[i] = UNUSED;
+Group groups[UTHREAD_GROUPS_MAX];
+int num_groups = 0; // below the root
+
+bool is_valid_group(int group) {
+  return group == UTHREAD_GROUP_ROOT or (group > 0 and group < UTHREAD_GROUPS_MAX and groups[group].used);
+}
+
+/* Starts the period of a capped group that now is, if the last one is over. */
+void refresh_period(Group &group, uint64_t now) {
+  if (group.quota != 0 and now - group.period_start >= group.period) {
+      group.period_start = now - (now - group.period_start) % group.period;
+      group.period_used = 0;
     }
-  scheduler = *new Scheduler(quantum_usecs);
-  scheduler.set_timer();
-  active_threads[0] = new Thread(0, nullptr);
-  if (!active_threads[0]) {
-      std::cerr << "system error: Memory allocation fails" << std::endl;
-      exit(1);
+}
+
+/* The smallest virtual runtime of the siblings of group with runnable threads, or UINT64_MAX if there is none. */
+uint64_t min_sibling_vruntime(int group) {
+  uint64_t min_vruntime = UINT64_MAX;
+  for (int sibling = 1; sibling < UTHREAD_GROUPS_MAX; sibling++) {
+      const Group &other = groups[sibling];
+      if (sibling != group and other.used and other.parent == groups[group].parent and other.runnable > 0
+          and other.vruntime < min_vruntime) {
+          min_vruntime = other.vruntime;
+        }
     }
-  active_threads[0]->set_state(RUNNING);
-  active_threads[0]->increment_quantums();
-  running_thread = 0;
-  total_quantum_num = 1;
-  return EXIT_SUCCESS;
+  return min_vruntime;
 }
 
-int uthread_spawn(thread_entry_point entry_point) {
-  block_timer_signal();
-  if (entry_point == nullptr){
-      std::cerr << "thread library error: thread cannot get nullptr as entry_point" << std::endl;
-      unblock_timer_signal();
-      return -1;
+/* Keeps the runnable counts of the groups of tid when it becomes runnable or stops being runnable. A group that
+   becomes runnable catches up with its runnable siblings, so an idle group cannot bank CPU time. */
+void count_runnable(int tid, bool was_runnable, bool is_runnable) {
+  if (was_runnable == is_runnable) {
+      return;
     }
-  int tid = -1;
-  for (int i = 1; i < MAX_THREAD_NUM; i++) {
-      if (ids_map[i] == UNUSED) {
-          tid = i;
-          ids_map[i] = USED;
-          break;
+  for (int group = threads[tid].get_group(); group != UTHREAD_GROUP_ROOT; group = groups[group].parent) {
+      if (!is_runnable) {
+          groups[group].runnable--;
+          continue;
+        }
+      if (groups[group].runnable++ == 0) {
+          uint64_t floor = min_sibling_vruntime(group);
+          if (floor != UINT64_MAX and groups[group].vruntime < floor) {
+              groups[group].vruntime = floor;
+            }
         }
     }
-  if (tid == -1) {
-      std::cerr << "thread library error: you reached the max number of threads" << std::endl;
-      unblock_timer_signal();
-      return -1;
-    }
+}
 
+void join_group(int tid, int group) {
+  threads[tid].set_group(group);
+  groups[group].members++;
+  count_runnable(tid, false, threads[tid].get_state() != BLOCKED);
+}
 
-  Thread *newThread = new(std::nothrow) Thread(tid, entry_point);
-  if (!newThread) {
-      std::cerr << "system error: Memory allocation fails" << std::endl;
-      exit(1);
-    }
-  active_threads[tid] = newThread;
-  ready_q.push_back(tid);
-  unblock_timer_signal();
-  return tid;
+/* The runnable count is taken care of by the caller. */
+void leave_group(int tid) {
+  groups[threads[tid].get_group()].members--;
+  threads[tid].set_group(UTHREAD_GROUP_ROOT);
 }
 
-int uthread_terminate(int tid) {
-  block_timer_signal();
-  if (active_threads.find(tid) == active_threads.end()) {
-      unblock_timer_signal();
-      std::cerr << "thread library error: tid is not exist" << std::endl;
-      return -1;
+void charge_group(int tid, uint64_t ran) {
+  uint64_t now = now_nsecs();
+  for (int group = threads[tid].get_group(); group != UTHREAD_GROUP_ROOT; group = groups[group].parent) {
+      refresh_period(groups[group], now);
+      groups[group].period_used += ran;
+      groups[group].vruntime += ran * UTHREAD_GROUP_WEIGHT_DEFAULT / groups[group].weight;
     }
+}
 
-  if (tid == 0) {
-      close_program();
-    }
-  if (active_threads[tid]->get_state() == RUNNING) {
-      forced_switch(-1, false, true);
-      return EXIT_SUCCESS;
+/* CPU time tid may still use in the current periods of its capped groups, UINT64_MAX if none is capped. */
+uint64_t group_quota_left(int tid) {
+  uint64_t left = UINT64_MAX;
+  uint64_t now = 0;
+  for (int group = threads[tid].get_group(); group != UTHREAD_GROUP_ROOT; group = groups[group].parent) {
+      Group &capped = groups[group];
+      if (capped.quota == 0) {
+          continue;
+        }
+      now = now == 0 ? now_nsecs() : now;
+      refresh_period(capped, now);
+      uint64_t group_left = capped.period_used < capped.quota ? capped.quota - capped.period_used : 0;
+      left = group_left < left ? group_left : left;
     }
-  if (active_threads[tid]->get_state() == READY) {
-      ready_q.remove(tid);
+  return left;
+}
+
+/* When the groups of tid that used up their quota start their next periods, or 0 if none did. */
+uint64_t group_throttled_until(int tid) {
+  uint64_t until = 0;
+  uint64_t now = 0;
+  for (int group = threads[tid].get_group(); group != UTHREAD_GROUP_ROOT; group = groups[group].parent) {
+      Group &capped = groups[group];
+      if (capped.quota == 0) {
+          continue;
+        }
+      now = now == 0 ? now_nsecs() : now;
+      refresh_period(capped, now);
+      if (capped.period_used >= capped.quota and capped.period_start + capped.period > until) {
+          until = capped.period_start + capped.period;
+        }
     }
+  return until;
+}
 
-  if (active_threads[tid]->get_state() == BLOCKED) {
-      if (sleeping_threads.find(tid) != sleeping_threads.end()) { sleeping_threads.erase(tid); }
-      if (blocked_threads.find(tid) != blocked_threads.end()) { blocked_threads.erase(tid); }
+/* Whether a group of tid ran ahead of its share, more than a quantum of virtual runtime past one of its runnable
+   siblings. */
+bool runs_ahead(int tid) {
+  uint64_t slack = scheduler.get_quantum_nsecs();
+  for (int group = threads[tid].get_group(); group != UTHREAD_GROUP_ROOT; group = groups[group].parent) {
+      uint64_t floor = min_sibling_vruntime(group);
+      if (floor != UINT64_MAX and groups[group].vruntime > floor + slack) {
+          return true;
+        }
     }
-  delete active_threads[tid];
-  active_threads.erase(tid);
-  ids_map[tid] = UNUSED;
-  unblock_timer_signal();
-  return EXIT_SUCCESS;
+  return false;
 }
 
-void close_program() {
-  for (auto it = active_threads.begin(); it != active_threads.end(); it++) {
-      delete it->second;
+/* Pops the next thread to run off the ready queue, enforcing the groups: a thread of a group that used up its quota is
+   throttled until the next period of the group, and a thread of a group that ran ahead of its share is passed over
+   in favour of the threads behind it, up to GROUP_PICK_ATTEMPTS of them, which go back to the end of their queue.
+   If only such threads are ready the first of them runs, so no CPU time is left unused. */
+int pick_next() {
+  if (num_groups == 0) {
+      return ready_q.pop_front();
     }
-  exit(0);
+  ThreadQueue passed;
+  int num_passed = 0;
+  int tid;
+  for (;;) {
+      tid = ready_q.pop_front();
+      if (tid == NO_TID) {
+          break;
+        }
+      uint64_t until = group_throttled_until(tid);
+      if (until != 0) {
+          scheduler.sleep_throttled(tid, until);
+          continue;
+        }
+      if (num_passed == GROUP_PICK_ATTEMPTS or !runs_ahead(tid)) {
+          break;
+        }
+      passed.push_back(tid);
+      num_passed++;
+    }
+  if (tid == NO_TID and !passed.empty()) {
+      tid = passed.pop_front();
+    }
+  while (!passed.empty()) {
+      ready_q.push_back(passed.pop_front());
+    }
+  return tid;
 }
 
-int uthread_block(int tid) {
-  block_timer_signal();
-  if (active_threads.find(tid) == active_threads.end()) {
-      std::cerr << "thread library error: tid is not exist" << std::endl;
-      unblock_timer_signal();
+
+int uthread_group_create(int parent, int weight) {
+  enter_critical_section();
+  if (!is_valid_group(parent)) {
+      std::cerr << "thread library error: group is not exist" << std::endl;
+      leave_critical_section();
       return -1;
     }
-  if (tid == 0) {
-      std::cerr << "thread library error: main thread cannot be blocked" << std::endl;
-      unblock_timer_signal();
+  if (weight < 1 or weight > UTHREAD_GROUP_WEIGHT_MAX) {
+      std::cerr << "thread library error: invalid group weight" << std::endl;
+      leave_critical_section();
       return -1;
     }
-
-  if (active_threads[tid]->get_state() == READY) {
-      ready_q.remove(tid);
-    }
-
-  if (active_threads[tid]->get_state() == RUNNING) {
-      forced_switch(-1, true, false);
-      return EXIT_SUCCESS;
+  for (int group = 1; group < UTHREAD_GROUPS_MAX; group++) {
+      if (!groups[group].used) {
+          groups[group] = Group();
+          groups[group].used = true;
+          groups[group].parent = parent;
+          groups[group].weight = weight;
+          if (parent != UTHREAD_GROUP_ROOT) {
+              groups[parent].children++;
+            }
+          num_groups++;
+          leave_critical_section();
+          return group;
+        }
     }
-  active_threads[tid]->set_state(BLOCKED);
-  blocked_threads.insert(tid);
-  unblock_timer_signal();
-  return EXIT_SUCCESS;
+  std::cerr << "thread library error: you reached the max number of groups" << std::endl;
+  leave_critical_section();
+  return -1;
 }
 
 
-int uthread_resume(int tid) {
-  block_timer_signal();
-  auto curr_thread = active_threads.find(tid);
-  if (curr_thread == active_threads.end()) { //tid is not exist
-      std::cerr << "thread library error: tid is not exist" << std::endl;
-      unblock_timer_signal();
+int uthread_group_destroy(int group) {
+  enter_critical_section();
+  if (group == UTHREAD_GROUP_ROOT or !is_valid_group(group)) {
+      std::cerr << "thread library error: group is not exist or is the root group" << std::endl;
+      leave_critical_section();
       return -1;
     }
-  auto curr_state = curr_thread->second->get_state();
-  bool is_sleeping = sleeping_threads.find(tid) != sleeping_threads.end();
-
-  if ((curr_state == BLOCKED) and is_sleeping) 
-    {
-      blocked_threads.erase(curr_thread->first);
-    } else if (curr_state == BLOCKED) {
-      curr_thread->second->set_state(READY);
-      blocked_threads.erase(tid);
-      ready_q.push_back(tid);
+  if (groups[group].members > 0 or groups[group].children > 0) {
+      std::cerr << "thread library error: group still has threads or groups" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (groups[group].parent != UTHREAD_GROUP_ROOT) {
+      groups[groups[group].parent].children--;
     }
-  unblock_timer_signal();
+  groups[group].used = false;
+  num_groups--;
+  leave_critical_section();
   return EXIT_SUCCESS;
 }
 
 
-int uthread_sleep(int num_quantums) {
-  block_timer_signal();
-  if (running_thread == 0) {
-      std::cerr << "thread library error: main thread can't call uthread_sleep function" << std::endl;
-      unblock_timer_signal();
+int uthread_group_set_quota(int group, int quota_usecs, int period_usecs) {
+  enter_critical_section();
+  if (group == UTHREAD_GROUP_ROOT or !is_valid_group(group)) {
+      std::cerr << "thread library error: group is not exist or is the root group" << std::endl;
+      leave_critical_section();
       return -1;
     }
-  if (num_quantums <= 0) {
-      std::cerr << "thread library error: num_quantums must be positive" << std::endl; //TODO - is it?
-      unblock_timer_signal();
+  if (quota_usecs < 0 or (quota_usecs > 0 and period_usecs <= 0)) {
+      std::cerr << "thread library error: invalid group quota" << std::endl;
+      leave_critical_section();
       return -1;
     }
-  forced_switch(num_quantums);
-  unblock_timer_signal();
+  groups[group].quota = (uint64_t) quota_usecs * NSECS_PER_USEC;
+  groups[group].period = (uint64_t) period_usecs * NSECS_PER_USEC;
+  groups[group].period_start = now_nsecs();
+  groups[group].period_used = 0;
+  leave_critical_section();
   return EXIT_SUCCESS;
 }
 
 
-int uthread_get_tid() {
-  return running_thread;
-}
-
-int uthread_get_total_quantums() {
-  return total_quantum_num;
+int uthread_group_attach(int tid, int group) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
+      std::cerr << "thread library error: tid is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  if (!is_valid_group(group)) {
+      std::cerr << "thread library error: group is not exist" << std::endl;
+      leave_critical_section();
+      return -1;
+    }
+  Thread &thread = threads[tid];
+  if (tid == running_thread) {
+      scheduler.charge_runtime(tid); // the old groups are charged for the time it ran in them
+    }
+  bool runnable = thread.get_state() != BLOCKED;
+  count_runnable(tid, runnable, false);
+  leave_group(tid);
+  join_group(tid, group);
+  if (thread.has_flag(FLAG_THROTTLED) and thread.get_deadline() == nullptr) { // its old quota no longer applies
+      awake_thread(tid);
+    } else if (thread.get_state() == RUNNING and tid == running_thread) {
+      scheduler.on_start_running(tid);
+    }
+  leave_critical_section();
+  return EXIT_SUCCESS;
 }
 
 
-int uthread_get_quantums(int tid) {
-  block_timer_signal();
-  if (active_threads.find(tid) == active_threads.end()) {
+int uthread_get_group(int tid) {
+  enter_critical_section();
+  if (!is_valid_tid(tid)) {
       std::cerr << "thread library error: tid is not exist" << std::endl;
-      unblock_timer_signal();
+      leave_critical_section();
       return -1;
     }
-  int quantums = active_threads[tid]->get_thread_quantums();
-  unblock_timer_signal();
-  return quantums;
+  int group = threads[tid].get_group();
+  leave_critical_section();
+  return group;
 }
-
-
-
@@ -6,12 +6,157 @@
 
 #ifndef _UTHREADS_H
 #define _UTHREADS_H
-#define MAX_THREAD_NUM 100 /* maximal number of threads */
-#define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <new>
+#include <utility>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <unistd.h>
+#endif
+
+#define MAX_THREAD_NUM 1048576 /* maximal number of threads, the thread table grows on demand */
+#define STACK_SIZE 65536 /* default stack size per thread (in bytes), mapped on demand */
+
+/* scheduling policies */
+#define UTHREAD_SCHED_RR 0 /* round robin inside strict priority levels */
+#define UTHREAD_SCHED_MLFQ 1 /* multi-level feedback queue */
+#define UTHREAD_SCHED_FAIR 2 /* fair share by weighted virtual runtime */
+
+#define UTHREAD_TIMER_VIRTUAL 0 /* quantums of user CPU time of the process, counted by ITIMER_VIRTUAL */
+#define UTHREAD_TIMER_CPU 1 /* quantums of CPU time of the process, user and system */
+#define UTHREAD_TIMER_MONOTONIC 2 /* quantums of wall-clock time, which also pass while threads wait in system calls */
+
+#define UTHREAD_LATENCY_BUCKETS 16 /* bucket 0 counts latencies under 1 us, bucket i those of [2^(i-1), 2^i) us */
+
+#define UTHREAD_PRIO_LEVELS 8 /* priorities are 0 (lowest) to UTHREAD_PRIO_LEVELS - 1 (highest) */
+#define UTHREAD_PRIO_DEFAULT 4 /* priority of the main thread and of threads created by uthread_spawn */
+
+#define UTHREAD_GROUPS_MAX 64 /* maximal number of thread groups, the root group included */
+#define UTHREAD_GROUP_ROOT 0 /* group of the main thread, and of the threads of no other group */
+#define UTHREAD_GROUP_WEIGHT_DEFAULT 100
+#define UTHREAD_GROUP_WEIGHT_MAX 10000
+
+#define UTHREAD_ANY_WORKER (-1) /* lets uthread_migrate return a thread to work stealing */
+
+#define UTHREAD_CHAN_UNBOUNDED (-1) /* capacity of a channel whose buffer grows on demand */
+#define UTHREAD_CHAN_SEND 0 /* operations of a select case */
+#define UTHREAD_CHAN_RECV 1
 
 
 
 typedef void (*thread_entry_point)(void);
+typedef void *(*thread_arg_entry_point)(void *);
+
+/* Wait queue of a synchronization object, managed by the library. */
+typedef struct uthread_wait_queue {
+  int head;
+  int tail;
+} uthread_wait_queue;
+
+typedef struct uthread_mutex {
+  int owner; /* tid of the thread holding the mutex, -1 if it is free */
+  uthread_wait_queue waiters;
+} uthread_mutex;
+
+typedef struct uthread_cond {
+  uthread_mutex *mutex; /* mutex of the current waiters */
+  uthread_wait_queue waiters;
+} uthread_cond;
+
+typedef struct uthread_sem {
+  int value;
+  uthread_wait_queue waiters;
+} uthread_sem;
+
+typedef struct uthread_rwlock {
+  int readers; /* number of threads holding the lock for reading */
+  int writer; /* tid of the thread holding it for writing, -1 if none */
+  uthread_wait_queue read_waiters;
+  uthread_wait_queue write_waiters;
+} uthread_rwlock;
+
+/* Static initializers, equivalent to the _init functions. A zero-filled object is not a valid one. */
+#define UTHREAD_WAIT_QUEUE_INITIALIZER {-1, -1}
+#define UTHREAD_MUTEX_INITIALIZER {-1, UTHREAD_WAIT_QUEUE_INITIALIZER}
+#define UTHREAD_COND_INITIALIZER {NULL, UTHREAD_WAIT_QUEUE_INITIALIZER}
+#define UTHREAD_SEM_INITIALIZER(value) {(value), UTHREAD_WAIT_QUEUE_INITIALIZER}
+#define UTHREAD_RWLOCK_INITIALIZER {0, -1, UTHREAD_WAIT_QUEUE_INITIALIZER, UTHREAD_WAIT_QUEUE_INITIALIZER}
+
+/* Channel carrying values of a fixed size between threads, managed by the library. */
+typedef struct uthread_chan uthread_chan;
+
+/* Moves the value at src into the uninitialized storage at dst. src stays owned by its caller. */
+typedef void (*uthread_chan_move_fn)(void *dst, void *src);
+
+/* Destroys a value left in the buffer of a channel. */
+typedef void (*uthread_chan_destroy_fn)(void *value);
+
+/* One operation of uthread_chan_select. */
+typedef struct uthread_chan_case {
+  uthread_chan *chan;
+  int op; /* UTHREAD_CHAN_SEND or UTHREAD_CHAN_RECV */
+  void *elem; /* value to send, or storage to receive into */
+  int closed; /* set by uthread_chan_select if the case completed because the channel is closed */
+} uthread_chan_case;
+
+#define UTHREAD_KEYS_MAX 1024 /* maximal number of thread-specific data keys */
+#define UTHREAD_DESTRUCTOR_ITERATIONS 4 /* passes over the values of a finishing thread that destructors may reset */
+
+/* Key of thread-specific data, see uthread_key_create. */
+typedef int uthread_key;
+
+/* Destroys the value of a key when its thread ends. */
+typedef void (*uthread_key_destructor)(void *value);
+
+/* Support of the coroutine tasks of namespace uthread, see uthread::task. */
+#define UTHREAD_TASK_PARKED 2 /* the task was switched out, and resumes at the handle it passed */
+#define UTHREAD_TASK_WAIT_BYTES 96 /* storage for a channel operation a task waits for */
+
+/* Runs a non-blocking I/O operation on behalf of a task. */
+typedef ssize_t (*uthread_task_io_fn)(void *context);
+
+/* Memory used by the library, as reported by uthread_get_memory_stats. */
+typedef struct uthread_memory_stats {
+  long threads; /* live threads, including the main thread */
+  long table_bytes; /* thread control blocks and their statistics, the table grows 1024 blocks at a time */
+  long mapped_stack_bytes; /* virtual size of all mapped stacks, including guard pages and cached stacks */
+  long resident_stack_bytes; /* stack pages of live threads that are actually backed by physical memory */
+  long cached_stacks; /* stacks kept in the stack pool */
+  long mapped_arena_bytes; /* chunks mapped by the thread arenas and the library, including the cached ones */
+} uthread_memory_stats;
+
+/* Scheduling statistics of a thread, as reported by uthread_get_stats. Times are in nanoseconds of wall-clock time
+   and include the current state of the thread. */
+typedef struct uthread_stats {
+  unsigned long long cpu_nsecs; /* spent RUNNING */
+  unsigned long long ready_wait_nsecs; /* spent READY, waiting to run */
+  unsigned long long sleep_nsecs; /* spent sleeping, or waiting for the next period of a deadline thread */
+  unsigned long long block_nsecs; /* spent blocked by uthread_block, or parked on a synchronization object, a channel,
+                                     a file descriptor or a join */
+  unsigned long long voluntary_switches; /* the thread gave up the CPU: yield, sleep, block or park */
+  unsigned long long involuntary_switches; /* the thread was preempted at the end of its quantum or by another one */
+  unsigned long long max_latency_nsecs; /* longest time from READY to RUNNING */
+  unsigned long long latency_histogram[UTHREAD_LATENCY_BUCKETS]; /* times from READY to RUNNING */
+} uthread_stats;
+
+/* Statistics of the whole scheduler, as reported by uthread_get_sched_stats. */
+typedef struct uthread_sched_stats {
+  int threads; /* threads in use, including the main thread and finished threads not joined yet */
+  int running;
+  int ready;
+  int blocked; /* sleeping, blocked, parked or finished and not joined yet */
+  int total_quantums;
+  unsigned long long voluntary_switches;
+  unsigned long long involuntary_switches;
+  unsigned long long ready_wait_nsecs; /* spent READY by all threads, up to their last start */
+  unsigned long long idle_nsecs; /* spent by the workers with no thread to run */
+  unsigned long long max_latency_nsecs;
+  unsigned long long latency_histogram[UTHREAD_LATENCY_BUCKETS];
+} uthread_sched_stats;
 
 
 /* External interface */
@@ -31,6 +176,44 @@ typedef void (*thread_entry_point)(void);
 */
 int uthread_init(int quantum_usecs);
 
+
+/**
+ * @brief initializes the thread library like uthread_init, with the given scheduling policy.
+ *
+ * Under both policies the scheduler always runs a READY thread of the highest priority, round robin among equal
+ * priorities, and a thread that becomes READY with a higher priority than the RUNNING one preempts it immediately.
+ * UTHREAD_SCHED_RR keeps every thread at the priority it was given, so without priorities it is the plain round
+ * robin of uthread_init.
+ * UTHREAD_SCHED_MLFQ adds feedback: a thread that uses up its whole quantum drops one level, a thread that blocks or
+ * sleeps before its quantum ends climbs back one level up to its own priority, and every 64 quantums all READY threads
+ * are lifted back to their own priority, so CPU-bound threads are not starved.
+ * UTHREAD_SCHED_FAIR gives every thread a share of the CPU proportional to a weight set by its priority, each level
+ * weighing 1.25 times the one below. Threads accumulate virtual runtime, the nanoseconds they actually ran divided by
+ * their weight, and the thread with the smallest virtual runtime runs next, so a thread that gives up the CPU early is
+ * not charged a whole quantum. A waking thread preempts the RUNNING one if it is behind by more than half a quantum.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init_policy(int quantum_usecs, int policy);
+
+/**
+ * @brief Initializes the thread library to run the threads on num_workers kernel threads (M:N), with round robin.
+ *
+ * The calling kernel thread becomes worker 0 and num_workers - 1 more are started. Each worker keeps its READY threads
+ * in a work-stealing deque, runs them round robin and has its own quantum timer, on its own CPU time, so preemption is
+ * per worker. A thread stays on the worker that spawned it, and an idle worker steals the oldest READY thread of
+ * another one. uthread_migrate moves a thread explicitly.
+ * The rest of the API is unchanged, but operations on the scheduler are serialized by one lock, so only the code
+ * of the threads runs in parallel. Thread priorities are kept but not used, and there are no deadline threads.
+ * A thread may resume on a different kernel thread after any preemption, so its code must not rely on kernel thread
+ * local storage such as errno across a point where it can be preempted.
+ * With num_workers 1 this is uthread_init. It is an error to call this function with num_workers outside [1, 256].
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init_workers(int quantum_usecs, int num_workers);
+
+
 /**
  * @brief Creates a new thread, whose entry point is the function entry_point with the signature
  * void entry_point(void).
@@ -46,6 +229,79 @@ int uthread_init(int quantum_usecs);
 int uthread_spawn(thread_entry_point entry_point);
 
 
+/**
+ * @brief Creates a new thread like uthread_spawn, with a stack of at least stack_size bytes.
+ *
+ * The size is rounded up to whole pages. Stacks are mapped on demand, so a large stack only uses physical memory for
+ * the pages the thread actually touches, and each stack has an inaccessible guard page below it, so an overflow
+ * faults instead of silently corrupting memory. The timer signal is handled on the stack of the running thread, and
+ * its frame alone can take several KB, so a stack much smaller than STACK_SIZE is only safe for a thread that is
+ * never preempted.
+ * It is an error to call this function with a null entry_point or a non-positive stack_size.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_stack(thread_entry_point entry_point, int stack_size);
+
+
+/**
+ * @brief Creates a new thread like uthread_spawn, with the given priority.
+ *
+ * If the priority is higher than the one of the calling thread, the new thread runs immediately.
+ * It is an error to call this function with a null entry_point or a priority outside [0, UTHREAD_PRIO_LEVELS).
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_prio(thread_entry_point entry_point, int priority);
+
+
+/**
+ * @brief Creates a new thread like uthread_spawn, whose entry point gets arg and returns the exit value of the thread.
+ *
+ * Returning from entry_point is equivalent to calling uthread_exit with the returned value. Such a thread is joinable:
+ * once it finished, its tid and exit value are kept until a thread joins it, so it must be joined exactly once, or
+ * its tid is never reused.
+ * It is an error to call this function with a null entry_point.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_arg(thread_arg_entry_point entry_point, void *arg);
+
+
+/**
+ * @brief Creates a new thread like uthread_spawn_arg, with a stack of at least stack_size bytes, as
+ * uthread_spawn_stack does.
+ *
+ * It is an error to call this function with a null entry_point or a non-positive stack_size.
+ *
+ * @return On success, return the ID of the created thread. On failure, return -1.
+*/
+int uthread_spawn_arg_stack(thread_arg_entry_point entry_point, void *arg, int stack_size);
+
+
+/**
+ * @brief Terminates the calling thread with the given exit value, which is passed to the threads joining it.
+ *
+ * Called by the main thread, it terminates the process as uthread_terminate(0) does. The function does not return.
+*/
+void uthread_exit(void *value);
+
+
+/**
+ * @brief Parks the calling thread until the thread with ID tid finishes, and stores its exit value in *value if value
+ * is not NULL.
+ *
+ * Any thread can be joined while it runs, by any number of threads, and all of them get its exit value; a joinable
+ * thread that already finished is released by the join. The exit value of a thread that was terminated with
+ * uthread_terminate, or returned from an entry point without a value, is NULL. A thread that is not joinable is
+ * released as soon as it finishes, so joining it afterwards is an error.
+ * It is an error to join the main thread, the calling thread itself, or a thread that does not exist.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_join(int tid, void **value);
+
+
 /**
  * @brief Terminates the thread with ID tid and deletes it from all relevant control structures.
  *
@@ -82,6 +338,19 @@ int uthread_block(int tid);
 int uthread_resume(int tid);
 
 
+/**
+ * @brief Moves the RUNNING thread to the end of the READY queue and runs the next READY thread.
+ *
+ * If no other thread is READY, or only threads of a lower priority are, the function returns immediately without a
+ * scheduling decision. Otherwise a new quantum starts, counted as any other, and the thread that runs next gets
+ * between half a quantum and a whole one, as after any switch. Sleepers that became due and threads whose descriptor
+ * became ready are only made READY at the next timer expiry. The main thread may yield as well.
+ *
+ * @return On success, return 0.
+*/
+int uthread_yield();
+
+
 /**
  * @brief Blocks the RUNNING thread for num_quantums quantums.
  *
@@ -98,6 +367,19 @@ int uthread_resume(int tid);
 int uthread_sleep(int num_quantums);
 
 
+/**
+ * @brief Blocks the RUNNING thread for at least usecs micro-seconds of wall-clock time.
+ *
+ * Like uthread_sleep, a scheduling decision is made immediately, and once the time is over the thread goes back to the
+ * end of the READY queue. Sleepers are checked whenever a new quantum starts, so the thread wakes up at the first
+ * quantum start after its deadline.
+ * It is considered an error if the main thread (tid == 0) calls this function, or if usecs is not positive.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sleep_usecs(int usecs);
+
+
 /**
  * @brief Returns the thread ID of the calling thread.
  *
@@ -111,6 +393,8 @@ int uthread_get_tid();
  *
  * Right after the call to uthread_init, the value should be 1.
  * Each time a new quantum starts, regardless of the reason, this number should be increased by 1.
+ * While the process idles, every quantum of elapsed time counts as a quantum. While a single thread can run, with no
+ * thread sleeping or waiting for I/O, its quantum is not interrupted and lasts until another thread becomes ready.
  *
  * @return The total number of quantums.
 */
@@ -129,7 +413,1061 @@ int uthread_get_total_quantums();
 int uthread_get_quantums(int tid);
 
 
+/**
+ * @brief Returns the number of nanoseconds the thread with ID tid spent in RUNNING state, including its current run.
+ *
+ * Runtime is measured in wall-clock time, whatever the timer source, so it also counts the time the thread spent in
+ * system calls. If no thread with ID tid exists it is considered an error.
+ *
+ * @return On success, return the runtime of the thread with ID tid. On failure, return -1.
+*/
+long long uthread_get_runtime_nsecs(int tid);
+
+
+/**
+ * @brief Selects the clock that measures quantums, one of the UTHREAD_TIMER_* sources.
+ *
+ * UTHREAD_TIMER_VIRTUAL is the default, and a thread that waits in a system call uses up no quantum.
+ * UTHREAD_TIMER_CPU counts the CPU time the process spends in the kernel too. Both CPU sources expire on kernel ticks,
+ * so quantums shorter than a tick last a tick. With several workers, each one counts its own CPU time under both.
+ * UTHREAD_TIMER_MONOTONIC counts wall-clock time with the resolution of a high-resolution timer, so threads doing
+ * blocking I/O are preempted on time although they use little CPU; the timer is stopped while the process idles.
+ * Under every source the timer is periodic, and only re-armed on a switch when less than half a quantum is left in
+ * the current period, so most switches make no system call and a thread may start with between half a quantum and
+ * a whole one. A new quantum starts on every worker when the source changes. It is an error to call this function with an unknown source.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_timer(int source);
+
+
+/**
+ * @brief Makes the quantum adapt to the load, or fixes it again at the length given to uthread_init if both arguments
+ * are 0.
+ *
+ * Adaptive quantums share target_latency_usecs among the threads that can run, so each of them runs once in that
+ * time: a few CPU-bound threads get long quantums and switch rarely, many threads get short ones. While most switches
+ * are made by threads that block or sleep before their quantum ends, quantums are shortened by up to half, so an
+ * interactive thread that wakes up waits less. No quantum is shorter than min_granularity_usecs, which also replaces
+ * half a quantum as the lead a waking thread needs to preempt under UTHREAD_SCHED_FAIR.
+ * uthread_sleep still counts quantums, and the quantums of an idle process still last the length given to
+ * uthread_init. With several workers each one adapts to its own runnable threads. The CPU timer sources round
+ * quantums up to kernel ticks, so short ones are only kept under UTHREAD_TIMER_MONOTONIC.
+ * It is an error to call this function with a negative argument, or with a minimum granularity that is 0 or longer
+ * than the target latency unless both are 0.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_adaptive_quantum(int target_latency_usecs, int min_granularity_usecs);
+
+
+/**
+ * @brief Sets the priority of the thread with ID tid.
+ *
+ * The thread is moved to the new level at once. If a READY thread now outranks the RUNNING one, a scheduling decision
+ * is made immediately. It is an error if no thread with ID tid exists or if priority is outside
+ * [0, UTHREAD_PRIO_LEVELS).
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_priority(int tid, int priority);
+
+
+/**
+ * @brief Returns the current priority of the thread with ID tid, which the MLFQ policy may have lowered.
+ *
+ * @return On success, return the priority. On failure, return -1.
+*/
+int uthread_get_priority(int tid);
+
+
+/**
+ * @brief Moves the thread with ID tid to the deadline scheduling class, or back to its priority if runtime_usecs is 0.
+ *
+ * A deadline thread reserves runtime_usecs of CPU time in every period of period_usecs, to be received within
+ * deadline_usecs of the start of the period. READY deadline threads run before all other threads, earliest absolute
+ * deadline first, whatever the policy. A new period starts with this call.
+ * Admission control rejects the reservation if the deadline threads together would need more than 95% of the CPU,
+ * counting runtime_usecs / deadline_usecs for each. The budget is enforced by the quantum timer: a thread that uses up
+ * its runtime is throttled until its next period, so it cannot starve the others. Sleepers are woken at quantum
+ * starts, so the quantum should be small compared to the deadlines.
+ * It is an error to call this function on the main thread, or unless 0 < runtime <= deadline <= period.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_set_deadline(int tid, int runtime_usecs, int deadline_usecs, int period_usecs);
+
+
+/**
+ * @brief Creates a thread group under the group parent, UTHREAD_GROUP_ROOT for a top-level group, with the given
+ * weight, between 1 and UTHREAD_GROUP_WEIGHT_MAX.
+ *
+ * Groups share the CPU like the cgroups of Linux. Sibling groups that have runnable threads, in them or in their
+ * descendants, get CPU time in proportion to their weights whatever their numbers of threads: when the scheduler
+ * picks the next thread, it passes over the threads of a group that ran ahead of its share for the threads behind
+ * them, so a burst of threads in one group cannot take over the quantums of another. Within a group, threads are
+ * scheduled by the policy as usual, and so are the threads of the root group itself, which are not weighed against
+ * the groups. A thread starts in the group of the thread that spawns it.
+ *
+ * @return On success, return the ID of the created group. On failure, return -1.
+*/
+int uthread_group_create(int parent, int weight);
+
+
+/**
+ * @brief Destroys group, which must have no threads and no child groups. The root group cannot be destroyed.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_group_destroy(int group);
+
+
+/**
+ * @brief Caps group to quota_usecs of CPU time in every period of period_usecs, or removes its cap if quota_usecs is
+ * 0.
+ *
+ * The quota covers the threads of the group and of its descendants, on all the workers together, and is enforced by
+ * the quantum timer like a deadline budget: once it is used up, the threads of the group are throttled until the
+ * next period, even if the CPU is idle otherwise. Under UTHREAD_TIMER_VIRTUAL the timer rounds up to kernel ticks,
+ * so a short quota is only kept under UTHREAD_TIMER_MONOTONIC. The root group cannot be capped.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_group_set_quota(int group, int quota_usecs, int period_usecs);
+
+
+/**
+ * @brief Moves the thread with ID tid to group.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_group_attach(int tid, int group);
+
+
+/**
+ * @brief Returns the group of the thread with ID tid.
+ *
+ * @return On success, return the ID of the group. On failure, return -1.
+*/
+int uthread_get_group(int tid);
+
+
+/**
+ * @brief Blocks the RUNNING deadline thread until its next period starts, with a full budget.
+ *
+ * A periodic task calls this at the end of each activation. It is an error to call it from a thread that is not in
+ * the deadline class.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_wait_period();
+
+
+/**
+ * @brief Moves the thread with ID tid to a worker and keeps it there, or lets it be stolen again if worker is
+ * UTHREAD_ANY_WORKER.
+ *
+ * A READY thread moves at once, and the RUNNING thread that moves itself switches to its new worker. A thread that
+ * runs on another worker, sleeps or is blocked moves when it is next scheduled. Idle workers never steal a thread that
+ * was moved this way.
+ * It is an error if no thread with ID tid exists or if worker is not a worker index.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_migrate(int tid, int worker);
+
+
+/**
+ * @brief Returns the index of the worker running the calling thread, 0 unless uthread_init_workers was used.
+ *
+ * @return The worker index.
+*/
+int uthread_get_worker();
+
+
+/**
+ * @brief Maps num_stacks stacks of stack_size bytes ahead of time and keeps them in the stack pool.
+ *
+ * The stacks of terminated threads are recycled through the pool, so once it is warm, spawning and terminating threads
+ * does not allocate. Up to 8 distinct stack sizes are cached. It is an error to reserve beyond the pool limit.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_pool_reserve(int num_stacks, int stack_size);
+
+
+/**
+ * @brief Sets the high-water mark of the stack pool. Stacks released beyond it are unmapped.
+ *
+ * Cached stacks above the new limit are released immediately. A limit of -1 (the default) means no limit.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_pool_set_limit(int max_cached_stacks);
+
+
+/**
+ * @brief Unmaps cached stacks until at most keep stacks are left in the pool.
+ *
+ * @return On success, return the number of stacks released. On failure, return -1.
+*/
+int uthread_pool_trim(int keep);
+
+
+/**
+ * @brief Fills stats with the memory currently used by the library.
+ *
+ * An idle thread with a default stack costs its control block plus the stack pages it has touched, usually a single
+ * page, so hundreds of thousands of mostly-idle threads fit in one process. Each guarded stack uses two kernel
+ * mappings, so once the stacks would take half of vm.max_map_count, new stacks get no guard page and are protected
+ * by a canary check only.
+ * Computing resident_stack_bytes queries the kernel for every stack, so this call is not meant for hot paths.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_memory_stats(uthread_memory_stats *stats);
+
+
+/**
+ * @brief Fills stats with the scheduling statistics of the thread with ID tid.
+ *
+ * The scheduler keeps them up to date at every state change of the thread, so reading them costs a copy, and a thread
+ * that starves shows a growing ready_wait_nsecs while it is still waiting. Statistics start when the thread is
+ * spawned. It is an error if no thread with ID tid exists or if stats is NULL.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_stats(int tid, uthread_stats *stats);
+
+
+/**
+ * @brief Fills stats with a snapshot of the statistics of the whole scheduler.
+ *
+ * The snapshot is kept up to date by the scheduler, so taking one costs a copy of a fixed size, however many threads
+ * there are, and does not hold the scheduler up. It is an error if stats is NULL.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_sched_stats(uthread_sched_stats *stats);
+
+
+/**
+ * @brief Writes the scheduler trace to the file at path, as Chrome trace JSON that chrome://tracing and Perfetto open
+ * as a timeline.
+ *
+ * The trace is only recorded when the library is built with UTHREADS_TRACE defined; otherwise recording costs
+ * nothing and this function fails. Each worker keeps its last 65536 events in a ring: thread runs, spawns, blocks,
+ * parks, resumes, sleeps, wake-ups and exits, timestamped with the TSC. A worker is a track of the timeline, with one
+ * slice per run of a thread and an instant event per other event.
+ * Dumping copies the rings while holding up the scheduler and writes the file after.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_trace_dump(const char *path);
+
+
+/*
+ * Synchronization primitives. A thread that has to wait is parked on the wait queue of the object and does not run
+ * again until the object is handed over to it: unlocking a mutex or a rwlock, or posting a semaphore, with waiters
+ * passes ownership directly to the first of them, in FIFO order, and never busy waits. Any thread, the main thread
+ * included, may wait. A parked thread that is also blocked with uthread_block keeps what it was handed and runs once
+ * it is resumed. Terminating a parked thread removes it from the wait queue; terminating a holder does not release
+ * the object.
+ */
+
+
+/**
+ * @brief Initializes mutex as unlocked.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_init(uthread_mutex *mutex);
+
+
+/**
+ * @brief Locks mutex, parking the calling thread until the mutex is handed over to it if it is held.
+ *
+ * Mutexes are not recursive: it is an error to lock a mutex the calling thread already holds.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_lock(uthread_mutex *mutex);
+
+
+/**
+ * @brief Locks mutex if it is free, without waiting.
+ *
+ * @return Return 0 if the mutex was locked, 1 if it is held. On failure, return -1.
+*/
+int uthread_mutex_trylock(uthread_mutex *mutex);
+
+
+/**
+ * @brief Unlocks mutex, which the calling thread must hold. If threads wait for it, the first one becomes its owner.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_mutex_unlock(uthread_mutex *mutex);
+
+
+/**
+ * @brief Initializes cond with no waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_init(uthread_cond *cond);
+
+
+/**
+ * @brief Atomically unlocks mutex, which the calling thread must hold, and parks the thread until cond is signalled.
+ *
+ * The thread returns holding mutex again. A signalled waiter is moved to the wait queue of the mutex rather than
+ * woken, so a broadcast does not make all waiters race for the mutex. All threads waiting on cond at the same time must
+ * use the same mutex.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_wait(uthread_cond *cond, uthread_mutex *mutex);
+
+
+/**
+ * @brief Wakes the first thread waiting on cond, if any.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_signal(uthread_cond *cond);
+
+
+/**
+ * @brief Wakes all the threads waiting on cond.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_cond_broadcast(uthread_cond *cond);
+
+
+/**
+ * @brief Initializes sem with value units.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_init(uthread_sem *sem, int value);
+
+
+/**
+ * @brief Takes a unit of sem, parking the calling thread until one is posted to it if there is none.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_wait(uthread_sem *sem);
+
+
+/**
+ * @brief Takes a unit of sem if there is one, without waiting.
+ *
+ * @return Return 0 if a unit was taken, 1 if there is none. On failure, return -1.
+*/
+int uthread_sem_trywait(uthread_sem *sem);
+
+
+/**
+ * @brief Adds a unit to sem. If threads wait on it, the unit goes to the first one.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sem_post(uthread_sem *sem);
+
+
+/**
+ * @brief Initializes rwlock as unlocked.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_rwlock_init(uthread_rwlock *rwlock);
+
+
+/**
+ * @brief Locks rwlock for reading, parking the calling thread while a writer holds it or waits for it.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_rwlock_rdlock(uthread_rwlock *rwlock);
+
+
+/**
+ * @brief Locks rwlock for writing, parking the calling thread while any thread holds it.
+ *
+ * When a writer unlocks, all the readers waiting at that time are admitted together before the next writer, so
+ * neither side can starve the other.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_rwlock_wrlock(uthread_rwlock *rwlock);
+
+
+/**
+ * @brief Releases rwlock, held by the calling thread for reading or writing, and hands it over to the waiters.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_rwlock_unlock(uthread_rwlock *rwlock);
+
+
+/*
+ * Thread-specific data. Each thread has its own value for every key, reached through its thread control block in
+ * constant time, and NULL until the thread sets it.
+ */
+
+
+/**
+ * @brief Creates a key of thread-specific data and stores it in *key.
+ *
+ * When a thread ends by returning from its entry point, calling uthread_exit or terminating itself, destructor, if not
+ * NULL, is called with each non-null value the thread has for the key. The values of a thread terminated by another
+ * thread, or of a task, are dropped without calling it.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_key_create(uthread_key *key, uthread_key_destructor destructor);
+
+
+/**
+ * @brief Deletes key. The values threads have for it are dropped without calling its destructor.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_key_delete(uthread_key key);
+
+
+/**
+ * @brief Returns the value the calling thread has for key, or NULL if it has none or key is not a key.
+*/
+void *uthread_getspecific(uthread_key key);
+
+
+/**
+ * @brief Sets the value the calling thread has for key.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_setspecific(uthread_key key, const void *value);
+
+
+/*
+ * Thread arenas. Each thread allocates from an arena of its own, which only it touches, so these functions take no
+ * lock and are safe under preemption, unlike malloc, which a preempted thread may hold locked.
+ */
+
+
+/**
+ * @brief Allocates a block of size bytes, aligned to 16 bytes, from the arena of the calling thread.
+ *
+ * Blocks of up to 8192 bytes come in size classes, bumped out of chunks of the arena and recycled when freed; larger
+ * blocks get a mapping of their own. A block can only be freed by the thread that allocated it, and all the blocks of
+ * a thread are released at once when it ends, however it ends, so none may outlive it. The blocks of a task that
+ * another thread terminates can still be freed by the destructors of the locals of its frame.
+ *
+ * @return Return the block.
+*/
+void *uthread_alloc(size_t size);
+
+
+/**
+ * @brief Returns block, allocated by the calling thread with uthread_alloc, to its arena. A NULL block is ignored.
+*/
+void uthread_free(void *block);
+
+
+/*
+ * Channels. A send parks the calling thread while the buffer of the channel is full, and a receive while it is empty.
+ * When a receiver is already parked a value goes directly from the sender to its storage, and when a sender is
+ * parked on an unbuffered channel directly to the receiver, without passing through the buffer. Values are moved with
+ * the move function of the channel, by copying their bytes by default, so large messages are best sent as pointers.
+ */
+
+
+/**
+ * @brief Creates a channel of values of elem_size bytes.
+ *
+ * A capacity of 0 makes an unbuffered channel, on which every send waits for a receiver, and UTHREAD_CHAN_UNBOUNDED
+ * a channel on which sends never wait.
+ *
+ * @return On success, return the channel. On failure, return NULL.
+*/
+uthread_chan *uthread_chan_create(size_t elem_size, int capacity);
+
+
+/**
+ * @brief Creates a channel as uthread_chan_create does, moving values with move and destroying the values left in it
+ * with destroy, for values that cannot be moved by copying their bytes.
+ *
+ * @return On success, return the channel. On failure, return NULL.
+*/
+uthread_chan *uthread_chan_create_typed(size_t elem_size, int capacity, uthread_chan_move_fn move,
+                                        uthread_chan_destroy_fn destroy);
+
+
+/**
+ * @brief Destroys chan and the values still buffered in it. No thread may be waiting on it.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_destroy(uthread_chan *chan);
+
+
+/**
+ * @brief Moves the value at elem into chan, parking the calling thread until there is room or a receiver for it.
+ *
+ * It is an error to send on a closed channel, or on a channel that gets closed while the thread waits.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_send(uthread_chan *chan, void *elem);
+
+
+/**
+ * @brief Moves the oldest value of chan into the storage at elem, parking the calling thread until there is one.
+ *
+ * @return Return 0 if a value was received, 1 if chan is closed and holds no more values. On failure, return -1.
+*/
+int uthread_chan_recv(uthread_chan *chan, void *elem);
+
+
+/**
+ * @brief Closes chan. Values already sent can still be received; waiting receivers return as for a drained closed
+ * channel and waiting senders fail.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_chan_close(uthread_chan *chan);
+
+
+/**
+ * @brief Runs one of count channel operations, the first that can complete starting from a position that rotates
+ * between calls.
+ *
+ * If none can complete and block is nonzero, the calling thread parks on all of them until one completes. A receive
+ * from a closed and drained channel completes with the closed field of its case set.
+ *
+ * @return Return the index of the completed case, or count if block is zero and none could complete. On failure,
+ * return -1.
+*/
+int uthread_chan_select(uthread_chan_case *cases, int count, int block);
+
+
+/*
+ * Non-blocking I/O. These wrappers behave like the system calls they are named after, returning -1 with errno set on
+ * failure, but where the call would block only the calling thread waits: the descriptor is switched to non-blocking
+ * mode on first use, and the thread parks until the reactor of the library reports the descriptor ready. Descriptors
+ * that cannot be polled, such as regular files, are used as they are.
+ */
+
+
+/**
+ * @brief Reads up to count bytes from fd into buf, parking the calling thread until data is available.
+ *
+ * @return Return the number of bytes read, 0 at end of file. On failure, return -1.
+*/
+ssize_t uthread_read(int fd, void *buf, size_t count);
+
+
+/**
+ * @brief Writes up to count bytes of buf to fd, parking the calling thread until there is room for some of them.
+ *
+ * @return Return the number of bytes written. On failure, return -1.
+*/
+ssize_t uthread_write(int fd, const void *buf, size_t count);
+
+
+/**
+ * @brief Accepts a connection on the listening socket fd, parking the calling thread until one arrives.
+ *
+ * @return Return the descriptor of the accepted socket. On failure, return -1.
+*/
+int uthread_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+
+/**
+ * @brief Connects the socket fd to addr, parking the calling thread until the connection is established or fails.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+
+/**
+ * @brief Closes fd. Threads parked on it are woken, and their operation fails.
+ *
+ * A descriptor used with the wrappers above must be closed with this function, so that the library forgets it before
+ * its number is reused.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_close(int fd);
+
+
+/*
+ * Coroutine tasks. These functions are the support of uthread::task below and are not meant to be called directly.
+ * The ones that take the handle of a suspending coroutine return UTHREAD_TASK_PARKED if they switched the running task
+ * out, after which the coroutine must suspend at once, without touching its frame, which may already be destroyed.
+ */
+
+
+/**
+ * @brief Makes the suspended coroutine frame a task with a tid of its own, scheduled with the threads.
+ *
+ * It is an error to call this function with a library built without C++20 coroutines.
+ *
+ * @return On success, return the ID of the task. On failure, return -1.
+*/
+int uthread_task_spawn(void *frame);
+
+
+/**
+ * @brief Switches the running task out if another thread or task of its rank is ready.
+ *
+ * @return Return UTHREAD_TASK_PARKED if the task was switched out, 0 if it keeps running.
+*/
+int uthread_task_yield(void *handle);
+
+
+/**
+ * @brief Switches the running task out for usecs microseconds of wall-clock time.
+ *
+ * @return Return UTHREAD_TASK_PARKED. On failure, return -1.
+*/
+int uthread_task_sleep_usecs(void *handle, int usecs);
+
+
+/**
+ * @brief Runs the channel operation op, parking the running task until it completes, with its waiting state in the
+ * UTHREAD_TASK_WAIT_BYTES of storage at wait, which must stay valid until the task resumes.
+ *
+ * @return Return UTHREAD_TASK_PARKED if the task waits, after which uthread_task_chan_result completes op, or 0 if op
+ * completed, setting its closed field. On failure, return -1.
+*/
+int uthread_task_chan_op(void *handle, uthread_chan_case *op, void *wait);
+
+
+/**
+ * @brief Completes op after the task that waited for it with the storage at wait resumed.
+ *
+ * @return On success, return 0, with the closed field of op set. On failure, return -1.
+*/
+int uthread_task_chan_result(void *wait, uthread_chan_case *op);
+
+
+/**
+ * @brief Runs op(context), a non-blocking operation on fd, parking the running task if fd is not ready for it.
+ *
+ * @return Return the result of op with *parked set to 0, or -1 with *parked set to 1 if the task was switched out
+ * until fd may be ready, in which case op has to be run again.
+*/
+ssize_t uthread_task_io(void *handle, int fd, int write, uthread_task_io_fn op, void *context, int *parked);
+
+
+namespace uthread {
+
+/*
+ * Thread-local variable of type T: each thread gets its own T, value-initialized on its first access and destroyed
+ * when the thread ends, as the values of a key of thread-specific data are. Like thread_local, it is meant to have
+ * static storage duration: its key is never deleted, since the process may end inside the library.
+ */
+template <typename T>
+class local {
+ public:
+  local() : key(-1) { uthread_key_create(&key, &destroy_value); }
+
+  local(const local &other) = delete;
+  local &operator=(const local &other) = delete;
+
+  /* The T of the calling thread. */
+  T &get() {
+    void *value = uthread_getspecific(key);
+    if (value == NULL) {
+        value = new T();
+        uthread_setspecific(key, value);
+      }
+    return *static_cast<T *>(value);
+  }
+
+  T &operator*() { return get(); }
+
+  T *operator->() { return &get(); }
+
+ private:
+  static void destroy_value(void *value) { delete static_cast<T *>(value); }
+
+  uthread_key key;
+};
+
+/*
+ * Channel of values of type T, moved with the move constructor of T. In a select, the storage of a receive case must
+ * be uninitialized storage for a T, where the received value is constructed, and the value of a send case is left
+ * moved-from.
+ */
+template <typename T>
+class channel {
+ public:
+  explicit channel(int capacity = 0)
+      : chan(uthread_chan_create_typed(sizeof(T), capacity, &move_value, &destroy_value)) {}
+
+  ~channel() {
+    if (chan != NULL) {
+        uthread_chan_destroy(chan);
+      }
+  }
+
+  channel(const channel &other) = delete;
+  channel &operator=(const channel &other) = delete;
+
+  /* Return 0 on success, -1 on failure. */
+  int send(T value) { return uthread_chan_send(chan, &value); }
+
+  /* Return 0 if a value was received, 1 if the channel is closed and drained, -1 on failure. */
+  int recv(T &value) {
+    alignas(T) unsigned char storage[sizeof(T)];
+    int result = uthread_chan_recv(chan, storage);
+    if (result == 0) {
+        T *received = reinterpret_cast<T *>(storage);
+        value = std::move(*received);
+        received->~T();
+      }
+    return result;
+  }
+
+  int close() { return uthread_chan_close(chan); }
+
+  uthread_chan *handle() const { return chan; }
+
+#if defined(__cpp_impl_coroutine)
+  class send_awaiter;
+  class recv_awaiter;
+
+  /* Awaitable send from a task, resulting in 0 on success, -1 on failure. */
+  send_awaiter send_async(T value) { return send_awaiter(chan, std::move(value)); }
+
+  /* Awaitable receive from a task, resulting in 0 if a value was received, 1 if the channel is closed and drained, -1
+     on failure. */
+  recv_awaiter recv_async(T &value) { return recv_awaiter(chan, value); }
+#endif
+
+ private:
+  static void move_value(void *dst, void *src) { new (dst) T(std::move(*static_cast<T *>(src))); }
+
+  static void destroy_value(void *value) { static_cast<T *>(value)->~T(); }
+
+  uthread_chan *chan;
+};
+
+#if defined(__cpp_impl_coroutine)
+
+/*
+ * Stackless tasks, C++20 coroutines that the scheduler runs like threads. A task spawned with uthread::spawn gets a
+ * tid and is scheduled by the same policy and ready queues as the threads, but has no stack: it runs on the stack of
+ * the scheduling loop of a worker, and its state between two suspensions is its coroutine frame, so a task costs a
+ * thread control block and a frame of a few hundred bytes.
+ *
+ * A task is never preempted and only gives up the CPU at a co_await: on sleep_usecs, yield, the send_async and
+ * recv_async operations of a channel, the I/O tasks, or on another task, which runs within the same task. It must not
+ * call the functions that park or switch the calling thread, which terminate the process when they would, nor
+ * terminate itself: it ends by returning. Its tid can be terminated by other threads and joined with uthread_join.
+ * Tasks need the library built as C++20 too.
+ */
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+/* Promise parts shared by all tasks: a task starts once awaited or spawned, and ends by resuming the coroutine that
+   awaits it, or by returning to the scheduler if it was spawned. */
+struct task_promise_base {
+  std::coroutine_handle<> continuation;
+
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  final_awaiter final_suspend() noexcept { return {}; }
+
+  /* Like an exception escaping the entry point of a thread. */
+  void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct task_promise : task_promise_base {
+  std::optional<T> value;
+
+  task<T> get_return_object() noexcept;
+
+  template <typename U>
+  void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+
+  T take() { return std::move(*value); }
+};
+
+template <>
+struct task_promise<void> : task_promise_base {
+  task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void take() noexcept {}
+};
+
+/* Awaits a support function that either switches the task out or completes at once. */
+template <typename Operation>
+class park_awaiter {
+ public:
+  explicit park_awaiter(Operation operation) : operation(operation), result(0) {}
+
+  bool await_ready() noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    int completed = operation(handle.address());
+    if (completed == UTHREAD_TASK_PARKED) {
+        return true;
+      }
+    result = completed;
+    return false;
+  }
+
+  /* Return 0 on success, -1 on failure. */
+  int await_resume() noexcept { return result; }
+
+ private:
+  Operation operation;
+  int result;
+};
+
+/* Channel operation of a task, which keeps the waiting state of the library in its frame. */
+class chan_awaiter {
+ public:
+  bool await_ready() noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    parked = true;
+    int completed = uthread_task_chan_op(handle.address(), &op, wait);
+    if (completed == UTHREAD_TASK_PARKED) {
+        return true;
+      }
+    parked = false;
+    result = completed;
+    return false;
+  }
+
+ protected:
+  chan_awaiter(uthread_chan *chan, int kind, void *elem) : op{chan, kind, elem, 0}, result(0), parked(false) {}
+
+  /* Return 0 if op completed, -1 on failure. */
+  int complete() { return parked ? uthread_task_chan_result(wait, &op) : result; }
+
+  uthread_chan_case op;
+
+ private:
+  int result;
+  bool parked;
+  alignas(void *) unsigned char wait[UTHREAD_TASK_WAIT_BYTES];
+};
+
+/* Runs call, a non-blocking I/O operation on fd. Each co_await is one attempt, resulting in whether it completed. */
+template <typename Call>
+class io_awaiter {
+ public:
+  io_awaiter(int fd, int write, Call call) : result(-1), fd(fd), write(write), call(call), done(false) {}
+
+  bool await_ready() noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> handle) noexcept {
+    int parked;
+    ssize_t completed = uthread_task_io(handle.address(), fd, write, &run, &call, &parked);
+    if (parked) {
+        return true;
+      }
+    result = completed;
+    done = true;
+    return false;
+  }
+
+  bool await_resume() noexcept {
+    bool completed = done;
+    done = false;
+    return completed;
+  }
+
+  ssize_t result;
+
+ private:
+  static ssize_t run(void *context) { return (*static_cast<Call *>(context))(); }
+
+  int fd;
+  int write;
+  Call call;
+  bool done;
+};
+
+}
+
+template <typename T>
+class channel<T>::send_awaiter : public detail::chan_awaiter {
+ public:
+  send_awaiter(uthread_chan *chan, T &&value)
+      : chan_awaiter(chan, UTHREAD_CHAN_SEND, nullptr), value(std::move(value)) { op.elem = &this->value; }
+
+  send_awaiter(send_awaiter &&other)
+      : chan_awaiter(other.op.chan, UTHREAD_CHAN_SEND, nullptr), value(std::move(other.value)) {
+    op.elem = &this->value;
+  }
+
+  int await_resume() { return complete(); }
+
+ private:
+  T value;
+};
+
+template <typename T>
+class channel<T>::recv_awaiter : public detail::chan_awaiter {
+ public:
+  recv_awaiter(uthread_chan *chan, T &value) : chan_awaiter(chan, UTHREAD_CHAN_RECV, storage), value(value) {}
+
+  recv_awaiter(recv_awaiter &&other) : chan_awaiter(other.op.chan, UTHREAD_CHAN_RECV, storage), value(other.value) {}
+
+  int await_resume() {
+    if (complete() != 0) {
+        return -1;
+      }
+    if (op.closed) {
+        return 1;
+      }
+    T *received = reinterpret_cast<T *>(storage);
+    value = std::move(*received);
+    received->~T();
+    return 0;
+  }
+
+ private:
+  T &value;
+  alignas(T) unsigned char storage[sizeof(T)];
+};
+
+/*
+ * Task returning a T, run by awaiting it from another task, or on its own with uthread::spawn for a task<void>.
+ */
+template <typename T>
+class task {
+ public:
+  using promise_type = detail::task_promise<T>;
+
+  task(task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+        if (handle) {
+            handle.destroy();
+          }
+        handle = other.handle;
+        other.handle = nullptr;
+      }
+    return *this;
+  }
+
+  task(const task &other) = delete;
+  task &operator=(const task &other) = delete;
+
+  ~task() {
+    if (handle) {
+        handle.destroy();
+      }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+
+  T await_resume() { return handle.promise().take(); }
+
+  /* Gives up the frame, which the caller has to destroy. */
+  void *release() noexcept {
+    void *frame = handle.address();
+    handle = nullptr;
+    return frame;
+  }
+
+ private:
+  friend struct detail::task_promise<T>;
+
+  explicit task(std::coroutine_handle<promise_type> handle) noexcept : handle(handle) {}
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+task<T> detail::task_promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::task_promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/* Schedules work as a task of its own. Return the tid of the task on success, -1 on failure. */
+inline int spawn(task<void> work) {
+  void *frame = work.release();
+  int tid = uthread_task_spawn(frame);
+  if (tid < 0) {
+      std::coroutine_handle<>::from_address(frame).destroy();
+    }
+  return tid;
+}
+
+/* Awaitable that suspends the running task for usecs microseconds, resulting in 0 on success, -1 on failure. */
+inline auto sleep_usecs(int usecs) {
+  return detail::park_awaiter([usecs](void *handle) { return uthread_task_sleep_usecs(handle, usecs); });
+}
+
+/* Awaitable that lets the threads and tasks of the rank of the running task run first. */
+inline auto yield() {
+  return detail::park_awaiter([](void *handle) { return uthread_task_yield(handle); });
+}
+
+/* Task reading up to count bytes from fd into buf, as uthread_read. */
+inline task<ssize_t> read(int fd, void *buf, size_t count) {
+  detail::io_awaiter io(fd, 0, [=]() { return ::read(fd, buf, count); });
+  while (!co_await io) {}
+  co_return io.result;
+}
+
+/* Task writing up to count bytes of buf to fd, as uthread_write. */
+inline task<ssize_t> write(int fd, const void *buf, size_t count) {
+  detail::io_awaiter io(fd, 1, [=]() { return ::write(fd, buf, count); });
+  while (!co_await io) {}
+  co_return io.result;
+}
+
+/* Task accepting a connection on the listening socket fd, as uthread_accept. */
+inline task<int> accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
+  detail::io_awaiter io(fd, 0, [=]() { return (ssize_t) ::accept(fd, addr, addrlen); });
+  while (!co_await io) {}
+  co_return (int) io.result;
+}
+
+#endif
 
+}
 
 
 
@@ -0,0 +1,331 @@
+/*
+ * Benchmarks of the uthreads library, to validate scheduler changes and catch regressions.
+ *
+ * Build and run, with the uthreads_bench target of CMakeLists.txt:
+ *   cmake -S . -B build -DCMAKE_BUILD_TYPE=Release && cmake --build build --target uthreads_bench
+ *   ./build/uthreads_bench [csv_path] [max_threads] [num_workers]
+ *
+ * The whole suite runs once per thread count, 1, 10, 100 and so on up to max_threads (10000 by default, at most
+ * MAX_THREAD_NUM - 1), on num_workers workers (1 by default, block_resume only runs with 1). The extra threads are
+ * spawned and blocked right away, so they are live threads the scheduler keeps track of without taking turns.
+ * Every result is a row of CSV, written to csv_path or to the standard output:
+ *   benchmark,threads,param,iterations,ns_per_op
+ * where ns_per_op is the mean time of one operation:
+ *   yield             one switch between two threads calling uthread_yield in turn
+ *   switch            one switch between two threads handing a semaphore back and forth
+ *   block_resume      one round trip of two threads resuming each other and blocking themselves
+ *   spawn_terminate   spawning a thread and terminating it before it runs
+ *   spawn_join        spawning a thread with uthread_spawn_arg, running it to its end and joining it
+ *   get_tid, get_quantums, set_priority, get_stats
+ *                     one call of the API function
+ *   alloc, malloc     allocating param bytes and freeing them, with uthread_alloc and with malloc
+ *   sleep_error       how late a thread wakes up from uthread_sleep_usecs(param), on average
+ *   sleep_error_max   the same, at worst
+ */
+#include "uthreads.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#define BENCH_QUANTUM_USECS 100000 /* long enough that preemption hardly shows in the measurements */
+#define BENCH_STACK_SIZE 65536 /* stack of the threads that run the benchmarks, which call into libc */
+#define BENCH_DEFAULT_MAX_THREADS 10000
+#define SWITCH_ROUNDS 100000
+#define SPAWN_ROUNDS 20000
+#define API_ROUNDS 1000000
+#define ALLOC_ROUNDS 1000000
+#define SLEEP_ROUNDS 100
+
+
+struct Result {
+  const char *benchmark;
+  int threads;
+  int param;
+  long iterations;
+  double ns_per_op;
+};
+
+std::vector<Result> results;
+int live_threads = 1; // threads of the process, the main thread included, while the suite runs
+std::vector<int> background; // spawned and blocked threads, padding the thread table
+
+uthread_sem ping;
+uthread_sem pong;
+int follower; // threads of block_resume
+int leader;
+uint64_t elapsed_nsecs; // measured by the thread that runs the benchmark
+
+
+uint64_t clock_nsecs() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+void record(const char *benchmark, int param, long iterations, uint64_t nsecs) {
+  results.push_back({benchmark, live_threads, param, iterations, (double) nsecs / (double) iterations});
+}
+
+/* Spawns a thread that runs entry_point to its end and waits for it. */
+void run_thread(thread_entry_point entry_point) {
+  int tid = uthread_spawn_stack(entry_point, BENCH_STACK_SIZE);
+  if (tid < 0 or uthread_join(tid, nullptr) != 0) {
+      fprintf(stderr, "benchmark error: cannot run a thread\n");
+      exit(1);
+    }
+}
+
+
+// --- yield ---
+
+void *yield_partner(void *arg) {
+  for (int i = 0; i < SWITCH_ROUNDS; i++) {
+      uthread_yield();
+    }
+  return arg;
+}
+
+void yield_measured() {
+  uint64_t start = clock_nsecs();
+  for (int i = 0; i < SWITCH_ROUNDS; i++) {
+      uthread_yield();
+    }
+  elapsed_nsecs = clock_nsecs() - start;
+  uthread_terminate(uthread_get_tid());
+}
+
+void bench_yield() {
+  int partner = uthread_spawn_arg(&yield_partner, nullptr);
+  run_thread(&yield_measured);
+  uthread_join(partner, nullptr);
+  record("yield", 0, 2L * SWITCH_ROUNDS, elapsed_nsecs);
+}
+
+
+// --- switch ---
+
+void switch_pinger() {
+  uint64_t start = clock_nsecs();
+  for (int i = 0; i < SWITCH_ROUNDS; i++) {
+      uthread_sem_post(&ping);
+      uthread_sem_wait(&pong);
+    }
+  elapsed_nsecs = clock_nsecs() - start;
+  uthread_terminate(uthread_get_tid());
+}
+
+void *switch_ponger(void *arg) {
+  for (int i = 0; i < SWITCH_ROUNDS; i++) {
+      uthread_sem_wait(&ping);
+      uthread_sem_post(&pong);
+    }
+  return arg;
+}
+
+void bench_switch() {
+  uthread_sem_init(&ping, 0);
+  uthread_sem_init(&pong, 0);
+  int ponger = uthread_spawn_arg(&switch_ponger, nullptr);
+  run_thread(&switch_pinger);
+  uthread_join(ponger, nullptr);
+  record("switch", 0, 2L * SWITCH_ROUNDS, elapsed_nsecs);
+}
+
+
+// --- block and resume ---
+
+/* Spawned before the leader, it blocks first, then each one resumes the other and blocks itself. The protocol relies
+   on a single worker, where a resumed thread cannot run before the thread that resumed it blocked. */
+void block_resume_follower() {
+  for (;;) {
+      uthread_block(uthread_get_tid());
+      uthread_resume(leader);
+    }
+}
+
+void block_resume_leader() {
+  uint64_t start = clock_nsecs();
+  for (int i = 0; i < SWITCH_ROUNDS; i++) {
+      uthread_resume(follower);
+      uthread_block(uthread_get_tid());
+    }
+  elapsed_nsecs = clock_nsecs() - start;
+  uthread_terminate(uthread_get_tid());
+}
+
+void bench_block_resume() {
+  follower = uthread_spawn_stack(&block_resume_follower, BENCH_STACK_SIZE);
+  leader = uthread_spawn_stack(&block_resume_leader, BENCH_STACK_SIZE);
+  uthread_join(leader, nullptr);
+  uthread_terminate(follower);
+  record("block_resume", 0, SWITCH_ROUNDS, elapsed_nsecs);
+}
+
+
+// --- spawn ---
+
+/* Entry point of the threads terminated by someone else. With several workers they may run before that. */
+void blocked_thread() {
+  for (;;) {
+      uthread_block(uthread_get_tid());
+    }
+}
+
+void *empty_arg_thread(void *arg) {
+  return arg;
+}
+
+void spawn_driver() {
+  uint64_t start = clock_nsecs();
+  for (int i = 0; i < SPAWN_ROUNDS; i++) {
+      uthread_terminate(uthread_spawn(&blocked_thread));
+    }
+  record("spawn_terminate", 0, SPAWN_ROUNDS, clock_nsecs() - start);
+  start = clock_nsecs();
+  for (int i = 0; i < SPAWN_ROUNDS; i++) {
+      uthread_join(uthread_spawn_arg(&empty_arg_thread, nullptr), nullptr);
+    }
+  record("spawn_join", 0, SPAWN_ROUNDS, clock_nsecs() - start);
+  uthread_terminate(uthread_get_tid());
+}
+
+
+// --- API calls ---
+
+void api_driver() {
+  int tid = uthread_get_tid();
+  volatile int sink = 0;
+  uint64_t start = clock_nsecs();
+  for (int i = 0; i < API_ROUNDS; i++) {
+      sink = sink + uthread_get_tid();
+    }
+  record("get_tid", 0, API_ROUNDS, clock_nsecs() - start);
+  start = clock_nsecs();
+  for (int i = 0; i < API_ROUNDS; i++) {
+      sink = sink + uthread_get_quantums(tid);
+    }
+  record("get_quantums", 0, API_ROUNDS, clock_nsecs() - start);
+  start = clock_nsecs();
+  for (int i = 0; i < API_ROUNDS; i++) {
+      uthread_set_priority(tid, UTHREAD_PRIO_DEFAULT);
+    }
+  record("set_priority", 0, API_ROUNDS, clock_nsecs() - start);
+  uthread_stats stats;
+  start = clock_nsecs();
+  for (int i = 0; i < API_ROUNDS; i++) {
+      uthread_get_stats(tid, &stats);
+    }
+  record("get_stats", 0, API_ROUNDS, clock_nsecs() - start);
+  uthread_terminate(tid);
+}
+
+
+// --- allocation ---
+
+void alloc_driver() {
+  const size_t sizes[] = {64, 1024};
+  for (size_t size : sizes) {
+      uint64_t start = clock_nsecs();
+      for (int i = 0; i < ALLOC_ROUNDS; i++) {
+          void *volatile block = uthread_alloc(size); // volatile, so the pair is not optimized away
+          uthread_free(block);
+        }
+      record("alloc", (int) size, ALLOC_ROUNDS, clock_nsecs() - start);
+      start = clock_nsecs();
+      for (int i = 0; i < ALLOC_ROUNDS; i++) {
+          void *volatile block = malloc(size);
+          free(block);
+        }
+      record("malloc", (int) size, ALLOC_ROUNDS, clock_nsecs() - start);
+    }
+  uthread_terminate(uthread_get_tid());
+}
+
+
+// --- sleep ---
+
+void sleep_driver() {
+  const int sleeps[] = {100, 1000, 10000};
+  for (int usecs : sleeps) {
+      uint64_t total = 0;
+      uint64_t worst = 0;
+      for (int i = 0; i < SLEEP_ROUNDS; i++) {
+          uint64_t start = clock_nsecs();
+          uthread_sleep_usecs(usecs);
+          uint64_t slept = clock_nsecs() - start;
+          uint64_t late = slept > (uint64_t) usecs * 1000 ? slept - (uint64_t) usecs * 1000 : 0;
+          total += late;
+          worst = late > worst ? late : worst;
+        }
+      record("sleep_error", usecs, SLEEP_ROUNDS, total);
+      record("sleep_error_max", usecs, 1, worst);
+    }
+  uthread_terminate(uthread_get_tid());
+}
+
+
+/* Spawns and blocks threads until the process has count of them. */
+void grow_to(int count) {
+  while (live_threads < count) {
+      int tid = uthread_spawn(&blocked_thread);
+      if (tid < 0 or uthread_block(tid) != 0) {
+          fprintf(stderr, "benchmark error: cannot spawn %d threads\n", count);
+          exit(1);
+        }
+      background.push_back(tid);
+      live_threads++;
+    }
+}
+
+void write_csv(FILE *out) {
+  fprintf(out, "benchmark,threads,param,iterations,ns_per_op\n");
+  for (const Result &result : results) {
+      fprintf(out, "%s,%d,%d,%ld,%.2f\n", result.benchmark, result.threads, result.param, result.iterations,
+              result.ns_per_op);
+    }
+}
+
+
+int main(int argc, char **argv) {
+  const char *csv_path = argc > 1 ? argv[1] : nullptr;
+  int max_threads = argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_MAX_THREADS;
+  int num_workers = argc > 3 ? atoi(argv[3]) : 1;
+  if (max_threads < 1 or max_threads >= MAX_THREAD_NUM) {
+      max_threads = MAX_THREAD_NUM - 1;
+    }
+  if (uthread_init_workers(BENCH_QUANTUM_USECS, num_workers) != 0) {
+      return 1;
+    }
+  for (int count = 1;; count = count * 10L < max_threads ? count * 10 : max_threads) {
+      grow_to(count);
+      bench_yield();
+      bench_switch();
+      if (num_workers == 1) {
+          bench_block_resume();
+        }
+      run_thread(&spawn_driver);
+      run_thread(&api_driver);
+      run_thread(&alloc_driver);
+      run_thread(&sleep_driver);
+      fprintf(stderr, "%d threads done\n", count);
+      if (count == max_threads) {
+          break;
+        }
+    }
+  for (int tid : background) {
+      uthread_terminate(tid);
+    }
+  FILE *out = csv_path != nullptr ? fopen(csv_path, "w") : stdout;
+  if (out == nullptr) {
+      fprintf(stderr, "benchmark error: cannot open %s\n", csv_path);
+      return 1;
+    }
+  write_csv(out);
+  if (out != stdout) {
+      fclose(out);
+    }
+  uthread_terminate(0);
+  return 0;
+}